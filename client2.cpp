@@ -1,35 +1,100 @@
-﻿#define _WINSOCK_DEPRECATED_NO_WARNINGS
+﻿#ifdef _WIN32
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
 #define NOMINMAX
 #include <winsock2.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#endif
 #include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <future>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
 #include <limits>
+#include <mutex>
 #include <sstream>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
-#pragma comment(lib, "ws2_32.lib")
-
 using namespace std;
 using namespace chrono;
 
-struct CommandPacket
+enum MessageType : uint8_t
+{
+    MSG_HELLO = 1,
+    MSG_WELCOME,
+    MSG_UPLOAD_MATRIX,
+    MSG_MATRIX_RECEIVED,
+    MSG_START_PROCESSING,
+    MSG_PROCESSING_STARTED,
+    MSG_INFO,
+    MSG_PROCESSING_COMPLETED,
+    MSG_REQUEST_STATUS,
+    MSG_STATUS,
+    MSG_REQUEST_RESULTS,
+    MSG_RESULTS,
+    MSG_ERROR,
+    MSG_BUSY,
+    MSG_SUBSCRIBE_PROGRESS,
+    MSG_PROGRESS,
+    MSG_REQUEST_DIAGONAL,
+    MSG_DIAGONAL,
+    MSG_DISCARD_TASK,
+    MSG_COMPUTE_BLOCK,
+    MSG_BLOCK_RESULT,
+    MSG_ATTACH_JOB,
+    MSG_OPERATE,
+    MSG_OPERATION_DONE,
+    MSG_REQUEST_MATRIX,
+    MSG_MATRIX              // [n][element type][bytes u64], the cells follow the frame
+};
+
+enum OperationCode : uint32_t
 {
-    uint32_t length;
-    char     command[256];
+    OP_TRANSPOSE = 1,
+    OP_MULTIPLY
 };
 
+// frame = [uint32 payload length][uint8 type][uint32 task id][payload]
+const size_t FRAME_HEADER_SIZE = 9;
+const char DEFAULT_UNIX_PATH[] = "/tmp/matrix-server.sock";
+
 struct MatrixUploadInfo 
 {
     uint32_t matrix_size;
     uint32_t num_threads;
-    uint32_t matrix_bytes;
+    uint64_t matrix_bytes;
+    uint32_t element_type;
+    uint32_t flags;
 };
 
+const uint32_t UPLOAD_SHARED = 1;   // flags: the cells are in a memfd sent with the frame
+const size_t UPLOAD_CHUNK_BYTES = 1u << 20;
+
 int recveiveAll(SOCKET s, char* buffer, int length)
 {
     int counter = 0;
@@ -60,39 +125,282 @@ int sendAll(SOCKET s, const char* data, int length)
     return counter;
 }
 
-bool sendCommand(SOCKET s, const string& cmd)
+void putU32(string& out, uint32_t v)
+{
+    v = htonl(v);
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void putU64(string& out, uint64_t v)
+{
+    putU32(out, static_cast<uint32_t>(v >> 32));
+    putU32(out, static_cast<uint32_t>(v));
+}
+
+void putF64(string& out, double d)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    putU32(out, static_cast<uint32_t>(bits >> 32));
+    putU32(out, static_cast<uint32_t>(bits));
+}
+
+uint32_t getU32(const string& in, size_t& pos)
 {
-    if (cmd.size() > 256)
+    if (pos + 4 > in.size())
     {
-        return false;
+        throw runtime_error("truncated payload");
     }
-    CommandPacket pkt{};
-    pkt.length = htonl(static_cast<uint32_t>(cmd.size()));
-    memcpy(pkt.command, cmd.data(), cmd.size());
-    return sendAll(s, reinterpret_cast<char*>(&pkt), sizeof(pkt)) == sizeof(pkt);
+    uint32_t v;
+    memcpy(&v, in.data() + pos, sizeof(v));
+    pos += 4;
+    return ntohl(v);
+}
+
+uint64_t getU64(const string& in, size_t& pos)
+{
+    uint64_t hi = getU32(in, pos);
+    return hi << 32 | getU32(in, pos);
 }
 
-bool receiveCommand(SOCKET s, string& outCmd)
+// Cell types the server can be asked for in the upload header.
+enum ElementType : uint32_t
 {
-    CommandPacket pkt{};
-    if (recveiveAll(s, reinterpret_cast<char*>(&pkt), sizeof(pkt)) != sizeof(pkt))
+    ELEM_INT16 = 1,
+    ELEM_INT32,
+    ELEM_INT64,
+    ELEM_FLOAT
+};
+
+template <typename T>
+constexpr uint32_t elementTypeOf()
+{
+    return is_floating_point<T>::value ? ELEM_FLOAT : sizeof(T) == 2 ? ELEM_INT16 : sizeof(T) == 4 ? ELEM_INT32 : ELEM_INT64;
+}
+
+// Calls f(T()) with the C++ type behind `type`.
+template <typename F>
+void withElementType(uint32_t type, F&& f)
+{
+    switch (type)
     {
-        return false;
+    case ELEM_INT16: f(int16_t()); break;
+    case ELEM_INT32: f(int32_t()); break;
+    case ELEM_INT64: f(int64_t()); break;
+    case ELEM_FLOAT: f(float()); break;
+    default: throw runtime_error("unsupported element type");
     }
-    uint32_t len = ntohl(pkt.length);
-    if (len > 256)
+}
+
+// Diagonal sums come back 64-bit for integer cells, double for float.
+template <typename T>
+using Accumulator = typename conditional<is_floating_point<T>::value, double, int64_t>::type;
+
+// What MULTIPLY wraps in: the server's products wrap modulo the cell width.
+template <typename T>
+using Wrap = typename conditional<is_floating_point<T>::value, T,
+    typename conditional<sizeof(T) <= 4, uint32_t, uint64_t>::type>::type;
+
+// On the wire a cell is big-endian in its own width; a float as its bit pattern.
+template <typename T>
+void putCell(char* out, T v)
+{
+    typedef typename conditional<sizeof(T) == 2, uint16_t, typename conditional<sizeof(T) == 4, uint32_t, uint64_t>::type>::type Bits;
+    Bits bits;
+    memcpy(&bits, &v, sizeof(bits));
+    for (size_t b = 0; b < sizeof(T); ++b)
+    {
+        out[b] = static_cast<char>(bits >> (8 * (sizeof(T) - 1 - b)));
+    }
+}
+
+template <typename T>
+T getCell(const char* in)
+{
+    typedef typename conditional<sizeof(T) == 2, uint16_t, typename conditional<sizeof(T) == 4, uint32_t, uint64_t>::type>::type Bits;
+    Bits bits = 0;
+    for (size_t b = 0; b < sizeof(T); ++b)
+    {
+        bits = static_cast<Bits>(bits << 8 | static_cast<unsigned char>(in[b]));
+    }
+    T v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// Collects several frames so they go out in a single send().
+struct FrameBatch
+{
+    string buffer;
+
+    void add(uint8_t type, uint32_t id, const string& payload = string())
+    {
+        putU32(buffer, static_cast<uint32_t>(payload.size()));
+        buffer.push_back(static_cast<char>(type));
+        putU32(buffer, id);
+        buffer += payload;
+    }
+
+    bool flush(SOCKET s)
+    {
+        bool ok = buffer.empty() || sendAll(s, buffer.data(), static_cast<int>(buffer.size())) == static_cast<int>(buffer.size());
+        buffer.clear();
+        return ok;
+    }
+};
+
+// Buffers incoming bytes so that small batched frames are parsed without a recv() per field.
+struct FrameReader
+{
+    SOCKET s;
+    vector<char> buffer = vector<char>(64 * 1024);
+    size_t begin = 0;
+    size_t end = 0;
+
+    bool fill(size_t need)
+    {
+        if (end - begin >= need)
+        {
+            return true;
+        }
+        if (begin > 0)
+        {
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        while (end < need)
+        {
+            int n = recv(s, buffer.data() + end, static_cast<int>(buffer.size() - end), 0);
+            if (n <= 0)
+            {
+                return false;
+            }
+            end += n;
+        }
+        return true;
+    }
+
+    bool read(uint8_t& type, uint32_t& id, string& payload)
+    {
+        if (!fill(FRAME_HEADER_SIZE))
+        {
+            return false;
+        }
+        uint32_t len;
+        memcpy(&len, buffer.data() + begin, sizeof(len));
+        len = ntohl(len);
+        type = static_cast<uint8_t>(buffer[begin + 4]);
+        memcpy(&id, buffer.data() + begin + 5, sizeof(id));
+        id = ntohl(id);
+        begin += FRAME_HEADER_SIZE;
+        payload.clear();
+        return readBody(payload, len);
+    }
+
+    // Appends the next `len` bytes of the stream to `out`.
+    bool readBody(string& out, uint64_t len)
+    {
+        size_t buffered = static_cast<size_t>(min<uint64_t>(len, end - begin));
+        out.append(buffer.data() + begin, buffered);
+        begin += buffered;
+        uint64_t target = out.size() + (len - buffered);
+        // `out` grows with what has arrived, so a length alone allocates nothing
+        while (out.size() < target)
+        {
+            size_t at = out.size();
+            size_t chunk = static_cast<size_t>(min<uint64_t>({ target - at, max<uint64_t>(at, 1u << 20), 1u << 30 }));
+            out.resize(at + chunk);
+            if (recveiveAll(s, &out[at], static_cast<int>(chunk)) != static_cast<int>(chunk))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+double getF64(const string& in, size_t& pos)
+{
+    uint64_t bits = static_cast<uint64_t>(getU32(in, pos)) << 32;
+    bits |= getU32(in, pos);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+
+#ifndef _WIN32
+// The descriptor rides on the first byte of the data; the rest is ordinary stream.
+bool sendWithFd(SOCKET s, const string& data, int fd)
+{
+    iovec iov{ const_cast<char*>(data.data()), data.size() };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(fd));
+
+    ssize_t n = sendmsg(s, &msg, 0);
+    if (n < 0)
     {
         return false;
     }
-    outCmd.assign(pkt.command, pkt.command + len);
-    return true;
+    int rest = static_cast<int>(data.size() - n);
+    return rest == 0 || sendAll(s, data.data() + n, rest) == rest;
 }
 
-int main()
+// Lets `fill` write the matrix into a sealed memfd; the server maps it instead
+// of receiving the cells over the socket.
+int makeSharedMatrix(size_t bytes, const function<void(void*)>& fill)
 {
-    WSADATA wd{};
-    WSAStartup(MAKEWORD(2, 2), &wd);
+    int fd = memfd_create("matrix", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    void* base = ftruncate(fd, bytes) == 0 ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (base == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    fill(base);
+    munmap(base, bytes);
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
 
+// Prefers the server's Unix socket (memfd uploads) and falls back to TCP.
+SOCKET connectServer(const string& unixPath, bool& local)
+{
+#ifndef _WIN32
+    if (!unixPath.empty())
+    {
+        SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un ua{};
+        ua.sun_family = AF_UNIX;
+        strncpy(ua.sun_path, unixPath.c_str(), sizeof(ua.sun_path) - 1);
+        if (connect(sock, reinterpret_cast<sockaddr*>(&ua), sizeof(ua)) == 0)
+        {
+            local = true;
+            return sock;
+        }
+        closesocket(sock);
+    }
+#endif
+    local = false;
     SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
     sockaddr_in srv{};
     srv.sin_family = AF_INET;
@@ -100,125 +408,1110 @@ int main()
     srv.sin_addr.s_addr = inet_addr("127.0.0.1");
     if (connect(sock, reinterpret_cast<sockaddr*>(&srv), sizeof(srv)) != 0)
     {
-        cerr << "Cannot connect to server\n";
-        return 1;
+        closesocket(sock);
+        return INVALID_SOCKET;
     }
+    return sock;
+}
 
-    sendCommand(sock, "HELLO");
-    string reply;
-    receiveCommand(sock, reply);
-    cout << "[s] " << reply << "\n";
+struct TaskResult
+{
+    int n = 0;
+    vector<pair<int, double>> seconds;  // thread count -> time, in the order they arrived
+};
 
-    cout << "Matrix size: ";
-    int n; cin >> n;
+struct TaskStatus
+{
+    int state = 0;              // 0 finished, 1 running, 2 waiting in the job queue
+    uint32_t done = 0;
+    uint32_t total = 0;
+    uint32_t position = 0;
+};
 
-    cout << "Enter thread counts (space‑separated, empty = default 1 2 4 8 16 32): ";
-    cin.ignore(numeric_limits<streamsize>::max(), '\n');
-    string line; getline(cin, line);
-    vector<int> cfg;
-    istringstream iss(line);
-    int t;
-    while (iss >> t)
+struct OperationResult
+{
+    uint32_t op = 0;
+    int n = 0;
+    double seconds = 0;
+};
+
+struct TaskProgress
+{
+    uint32_t cfgIdx = 0;
+    uint32_t cfgTotal = 0;
+    uint32_t rows = 0;
+    uint32_t rowsTotal = 0;
+    double rate = 0;
+    double eta = 0;
+};
+
+// Asynchronous client: every upload/run is a task with its own id, any number of
+// them can be in flight over one connection, and every request returns a future.
+// A reader thread routes replies by id; the server answers a connection's requests
+// in order, so each task keeps a FIFO of handlers for the replies still owed.
+// Callbacks run on the reader thread and must not block on this client's futures.
+class MatrixClient
+{
+public:
+    function<void(uint32_t, int, double)> onInfo;
+    function<void(uint32_t, const TaskProgress&)> onProgress;
+    function<void(uint32_t)> onStarted;
+    function<void(uint32_t, uint32_t)> onBusy;
+    // how long a START or OPERATE keeps being resent after BUSY before it fails
+    milliseconds busyTimeout{ 120000 };
+
+    ~MatrixClient() { close(); }
+
+    bool connect(const string& unixPath);
+    bool isLocal() const { return local; }
+    uint32_t createTask() { return nextTask++; }
+
+    future<void> hello();
+    // both resolve to the server's job id, 0 unless the server runs with --store-dir
+    template <typename T>
+    future<uint32_t> upload(uint32_t task, int n, const vector<int>& cfg, const function<void(T*, size_t)>& fill);
+    future<uint32_t> attach(uint32_t task, uint32_t jobId);
+    future<TaskResult> run(uint32_t task, uint32_t progressIntervalMs = 0);
+    future<TaskStatus> status(uint32_t task);
+    future<TaskResult> results(uint32_t task);
+    template <typename T>
+    future<vector<Accumulator<T>>> diagonal(uint32_t task);
+    // fills `result` with op(operands...) on the server; operands are tasks of this connection
+    future<OperationResult> operate(uint32_t result, uint32_t op, const vector<uint32_t>& operands, int threads);
+    template <typename T>
+    future<vector<T>> matrix(uint32_t task);
+    void discard(uint32_t task);
+    void close();
+
+private:
+    typedef function<void(uint8_t, const string&)> ReplyHandler;
+
+    struct TaskState
     {
-        if (t > 0)
+        int n = 0;
+        deque<ReplyHandler> replies;
+        shared_ptr<promise<TaskResult>> run;
+        TaskResult partial;
+        shared_ptr<promise<OperationResult>> operation;
+        bool discarded = false;
+        steady_clock::time_point busySince;     // first BUSY of the pending request, epoch = none
+    };
+
+    SOCKET sock = INVALID_SOCKET;
+    bool local = false;
+    atomic<uint32_t> nextTask{ 1 };
+    mutex sendMtx;              // taken before mtx so handlers queue in send order
+    mutex mtx;
+    bool connected = false;
+    unordered_map<uint32_t, TaskState> tasks;
+    thread reader;
+
+    mutex timerMtx;
+    condition_variable timerCv;
+    multimap<steady_clock::time_point, function<void()>> retries;   // requests to resend after BUSY
+    bool stopping = false;
+    thread timer;
+
+    // `body` sends what follows the frames (upload cells) while the send lock is held
+    void request(uint32_t task, const string& frames, int fd, ReplyHandler handler, const function<void()>& body = nullptr);
+    ReplyHandler onReceived(uint32_t task, shared_ptr<promise<uint32_t>> p);
+    void sendStart(uint32_t task);
+    void sendOperate(uint32_t result, const string& payload);
+    bool retryLater(uint32_t task, const string& payload, function<void()> resend);
+    void clearBusy(uint32_t task);
+    void failRun(uint32_t task, const string& why);
+    void readLoop();
+    void timerLoop();
+
+    template <typename T>
+    future<T> ask(uint32_t task, uint8_t type, uint8_t expected, function<T(const string&)> parse)
+    {
+        auto p = make_shared<promise<T>>();
+        FrameBatch batch;
+        batch.add(type, task);
+        request(task, batch.buffer, -1, [p, expected, parse](uint8_t reply, const string& payload)
+            {
+            try
+            {
+                if (reply != expected)
+                {
+                    throw runtime_error(reply == MSG_ERROR ? payload : "unexpected reply " + to_string(reply));
+                }
+                p->set_value(parse(payload));
+            }
+            catch (...)
+            {
+                p->set_exception(current_exception());
+            }
+            });
+        return p->get_future();
+    }
+};
+
+bool MatrixClient::connect(const string& unixPath)
+{
+    sock = connectServer(unixPath, local);
+    if (sock == INVALID_SOCKET)
+    {
+        return false;
+    }
+    connected = true;
+    reader = thread(&MatrixClient::readLoop, this);
+    timer = thread(&MatrixClient::timerLoop, this);
+    return true;
+}
+
+void MatrixClient::close()
+{
+    if (sock == INVALID_SOCKET)
+    {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(timerMtx);
+        stopping = true;
+    }
+    timerCv.notify_all();
+    shutdown(sock, 2);
+    if (reader.joinable())
+    {
+        reader.join();
+    }
+    if (timer.joinable())
+    {
+        timer.join();
+    }
+    ::closesocket(sock);
+    sock = INVALID_SOCKET;
+}
+
+void MatrixClient::request(uint32_t task, const string& frames, int fd, ReplyHandler handler, const function<void()>& body)
+{
+    lock_guard<mutex> sendLock(sendMtx);
+    {
+        lock_guard<mutex> lock(mtx);
+        if (connected)
         {
-            cfg.push_back(t);
+            tasks[task].replies.push_back(move(handler));
+            handler = nullptr;
         }
     }
-    if (cfg.empty())
+    if (handler)
     {
-        cfg = { 1, 2, 4, 8, 16, 32 };
+        handler(MSG_ERROR, "connection lost");
+        return;
+    }
+    // a failed send shows up as EOF on the reader, which fails the handler
+#ifndef _WIN32
+    if (fd >= 0)
+    {
+        sendWithFd(sock, frames, fd);
+        return;
     }
-    vector<vector<int>> matrix(n, vector<int>(n));
-    for (auto& row : matrix)
+#endif
+    (void)fd;
+    sendAll(sock, frames.data(), static_cast<int>(frames.size()));
+    if (body)
     {
-        for (int& v : row)
+        body();
+    }
+}
+
+future<void> MatrixClient::hello()
+{
+    auto p = make_shared<promise<void>>();
+    FrameBatch batch;
+    batch.add(MSG_HELLO, 0);
+    request(0, batch.buffer, -1, [p](uint8_t reply, const string& payload)
         {
-            v = rand() % 1000;
+        if (reply == MSG_WELCOME)
+        {
+            p->set_value();
+        }
+        else
+        {
+            p->set_exception(make_exception_ptr(runtime_error(reply == MSG_ERROR ? payload : "unexpected reply")));
         }
+        });
+    return p->get_future();
+}
+
+template <typename T>
+future<uint32_t> MatrixClient::upload(uint32_t task, int n, const vector<int>& cfg, const function<void(T*, size_t)>& fill)
+{
+    size_t count = static_cast<size_t>(n) * n;
+    int sharedFd = -1;
+#ifndef _WIN32
+    if (local)
+    {
+        sharedFd = makeSharedMatrix(count * sizeof(T), [&](void* base) { fill(static_cast<T*>(base), count); });
+    }
+#endif
+    string header;
+    putU32(header, n);
+    putU32(header, static_cast<uint32_t>(cfg.size()));
+    putU64(header, count * sizeof(T));
+    putU32(header, elementTypeOf<T>());
+    putU32(header, sharedFd >= 0 ? UPLOAD_SHARED : 0);
+    for (int c : cfg)
+    {
+        putU32(header, c);
     }
-    sendCommand(sock, "UPLOAD_MATRIX");
-    MatrixUploadInfo hdr{};
-    hdr.matrix_size = htonl(n);
-    hdr.num_threads = htonl(static_cast<uint32_t>(cfg.size()));
-    hdr.matrix_bytes = htonl(n * n * sizeof(int));
-    sendAll(sock, reinterpret_cast<char*>(&hdr), sizeof(hdr));
+    FrameBatch batch;
+    batch.add(MSG_UPLOAD_MATRIX, task, header);
 
-    vector<int> cfgNet(cfg.size());
-    for (size_t i = 0; i < cfg.size(); ++i)
+    // without a memfd the cells follow the frame, encoded a chunk at a time
+    vector<T> cells;
+    if (sharedFd < 0)
     {
-        cfgNet[i] = htonl(cfg[i]);
+        cells.resize(count);
+        fill(cells.data(), count);
     }
-    sendAll(sock, reinterpret_cast<char*>(cfgNet.data()), cfgNet.size() * sizeof(int));
+    auto body = [this, &cells]()
+        {
+        string chunk;
+        size_t perChunk = UPLOAD_CHUNK_BYTES / sizeof(T);
+        for (size_t k = 0; k < cells.size(); k += perChunk)
+        {
+            size_t m = min(perChunk, cells.size() - k);
+            chunk.resize(m * sizeof(T));
+            for (size_t c = 0; c < m; ++c)
+            {
+                putCell(&chunk[c * sizeof(T)], cells[k + c]);
+            }
+            if (sendAll(sock, chunk.data(), static_cast<int>(chunk.size())) < 0)
+            {
+                return;
+            }
+        }
+        };
+
+    auto p = make_shared<promise<uint32_t>>();
+    request(task, batch.buffer, sharedFd, onReceived(task, p), body);
+#ifndef _WIN32
+    if (sharedFd >= 0)
+    {
+        ::close(sharedFd);
+    }
+#endif
+    return p->get_future();
+}
+
+future<uint32_t> MatrixClient::attach(uint32_t task, uint32_t jobId)
+{
+    string payload;
+    putU32(payload, jobId);
+    FrameBatch batch;
+    batch.add(MSG_ATTACH_JOB, task, payload);
+    auto p = make_shared<promise<uint32_t>>();
+    request(task, batch.buffer, -1, onReceived(task, p));
+    return p->get_future();
+}
+
+// MATRIX_RECEIVED = [job id][matrix size], the answer to both UPLOAD and ATTACH.
+MatrixClient::ReplyHandler MatrixClient::onReceived(uint32_t task, shared_ptr<promise<uint32_t>> p)
+{
+    return [this, p, task](uint8_t reply, const string& payload)
+        {
+        try
+        {
+            if (reply != MSG_MATRIX_RECEIVED)
+            {
+                throw runtime_error(reply == MSG_ERROR ? payload : "unexpected reply");
+            }
+            size_t pos = 0;
+            uint32_t jobId = getU32(payload, pos);
+            int n = getU32(payload, pos);
+            {
+                lock_guard<mutex> lock(mtx);
+                tasks[task].n = n;
+            }
+            p->set_value(jobId);
+        }
+        catch (...)
+        {
+            p->set_exception(current_exception());
+        }
+        };
+}
 
-    vector<int> flat; 
-    flat.reserve(n * n);
-    for (auto& row : matrix)
+// Resolves when PROCESSING_COMPLETED arrives, with the times pushed as INFO frames.
+future<TaskResult> MatrixClient::run(uint32_t task, uint32_t progressIntervalMs)
+{
+    auto p = make_shared<promise<TaskResult>>();
     {
-        flat.insert(flat.end(), row.begin(), row.end());
+        lock_guard<mutex> lock(mtx);
+        TaskState& st = tasks[task];
+        if (st.run)
+        {
+            p->set_exception(make_exception_ptr(runtime_error("task is already running")));
+            return p->get_future();
+        }
+        st.run = p;
+        st.partial = TaskResult();
+        st.partial.n = st.n;
     }
-    for (int& v : flat)
+    // the subscription has no reply; send it together with the first START
+    FrameBatch batch;
+    string interval;
+    putU32(interval, progressIntervalMs);
+    batch.add(MSG_SUBSCRIBE_PROGRESS, task, interval);
     {
-        v = htonl(v);
+        lock_guard<mutex> sendLock(sendMtx);
+        batch.flush(sock);
     }
-    sendAll(sock, reinterpret_cast<char*>(flat.data()), flat.size() * sizeof(int));
+    sendStart(task);
+    return p->get_future();
+}
 
-    receiveCommand(sock, reply);
-    cout << "[s] " << reply << "\n";
+void MatrixClient::sendStart(uint32_t task)
+{
+    FrameBatch batch;
+    batch.add(MSG_START_PROCESSING, task);
+    request(task, batch.buffer, -1, [this, task](uint8_t reply, const string& payload)
+        {
+        if (reply == MSG_PROCESSING_STARTED)
+        {
+            clearBusy(task);
+            if (onStarted)
+            {
+                onStarted(task);
+            }
+        }
+        else if (reply == MSG_BUSY)
+        {
+            if (!retryLater(task, payload, [this, task]() { sendStart(task); }))
+            {
+                failRun(task, "BUSY: server still saturated after " + to_string(busyTimeout.count() / 1000) + " s");
+            }
+        }
+        else
+        {
+            failRun(task, reply == MSG_ERROR ? payload : "unexpected reply");
+        }
+        });
+}
 
-    sendCommand(sock, "START_PROCESSING");
+// BUSY = [retry after ms]; the timer thread resends once that has passed. Returns
+// false, resending nothing, when that would run past busyTimeout since the first BUSY.
+bool MatrixClient::retryLater(uint32_t task, const string& payload, function<void()> resend)
+{
+    size_t pos = 0;
+    uint32_t retryAfterMs = getU32(payload, pos);
+    auto now = steady_clock::now();
+    auto due = now + milliseconds(retryAfterMs);
+    {
+        lock_guard<mutex> lock(mtx);
+        TaskState& st = tasks[task];
+        if (st.busySince == steady_clock::time_point())
+        {
+            st.busySince = now;
+        }
+        if (due - st.busySince > busyTimeout)
+        {
+            st.busySince = steady_clock::time_point();
+            return false;
+        }
+    }
+    if (onBusy)
+    {
+        onBusy(task, retryAfterMs);
+    }
+    {
+        lock_guard<mutex> lock(timerMtx);
+        retries.emplace(due, move(resend));
+    }
+    timerCv.notify_one();
+    return true;
+}
+
+void MatrixClient::clearBusy(uint32_t task)
+{
+    lock_guard<mutex> lock(mtx);
+    auto it = tasks.find(task);
+    if (it != tasks.end())
+    {
+        it->second.busySince = steady_clock::time_point();
+    }
+}
+
+void MatrixClient::failRun(uint32_t task, const string& why)
+{
+    shared_ptr<promise<TaskResult>> p;
+    {
+        lock_guard<mutex> lock(mtx);
+        auto it = tasks.find(task);
+        if (it != tasks.end())
+        {
+            p = move(it->second.run);
+        }
+    }
+    if (p)
+    {
+        p->set_exception(make_exception_ptr(runtime_error(why)));
+    }
+}
 
-    atomic<bool> done(false);
-    string finalResult;
-    atomic<bool> resultReady = false;
+future<TaskStatus> MatrixClient::status(uint32_t task)
+{
+    return ask<TaskStatus>(task, MSG_REQUEST_STATUS, MSG_STATUS, [](const string& msg)
+        {
+        TaskStatus st;
+        st.state = msg.at(0);
+        size_t pos = 1;
+        st.done = getU32(msg, pos);
+        st.total = getU32(msg, pos);
+        st.position = getU32(msg, pos);
+        return st;
+        });
+}
 
+future<TaskResult> MatrixClient::results(uint32_t task)
+{
+    return ask<TaskResult>(task, MSG_REQUEST_RESULTS, MSG_RESULTS, [](const string& msg)
+        {
+        TaskResult r;
+        size_t pos = 0;
+        r.n = getU32(msg, pos);
+        uint32_t count = getU32(msg, pos);
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            int thr = getU32(msg, pos);
+            double seconds = getF64(msg, pos);
+            r.seconds.emplace_back(thr, seconds);
+        }
+        return r;
+        });
+}
 
-    thread listener([&] 
+template <typename T>
+future<vector<Accumulator<T>>> MatrixClient::diagonal(uint32_t task)
+{
+    return ask<vector<Accumulator<T>>>(task, MSG_REQUEST_DIAGONAL, MSG_DIAGONAL, [](const string& msg)
         {
-        string msg;
-        while (receiveCommand(sock, msg))
+        size_t pos = 0;
+        vector<Accumulator<T>> diag(getU32(msg, pos));
+        for (auto& v : diag)
         {
-            if (msg.rfind("INFO:", 0) == 0 || msg.rfind("STATUS:", 0) == 0)
+            uint64_t bits = getU64(msg, pos);
+            memcpy(&v, &bits, sizeof(v));
+        }
+        return diag;
+        });
+}
+
+future<OperationResult> MatrixClient::operate(uint32_t result, uint32_t op, const vector<uint32_t>& operands, int threads)
+{
+    auto p = make_shared<promise<OperationResult>>();
+    {
+        lock_guard<mutex> lock(mtx);
+        TaskState& st = tasks[result];
+        if (st.operation)
+        {
+            p->set_exception(make_exception_ptr(runtime_error("an operation is already filling this task")));
+            return p->get_future();
+        }
+        st.operation = p;
+    }
+    string payload;
+    putU32(payload, op);
+    putU32(payload, threads);
+    putU32(payload, static_cast<uint32_t>(operands.size()));
+    for (uint32_t operand : operands)
+    {
+        putU32(payload, operand);
+    }
+    sendOperate(result, payload);
+    return p->get_future();
+}
+
+void MatrixClient::sendOperate(uint32_t result, const string& payload)
+{
+    FrameBatch batch;
+    batch.add(MSG_OPERATE, result, payload);
+    // PROCESSING_STARTED acknowledges it; OPERATION_DONE comes later, like a run's COMPLETED
+    request(result, batch.buffer, -1, [this, result, payload](uint8_t reply, const string& msg)
+        {
+        if (reply == MSG_PROCESSING_STARTED)
+        {
+            clearBusy(result);
+            return;
+        }
+        string why = reply == MSG_ERROR ? msg : "unexpected reply";
+        if (reply == MSG_BUSY)
+        {
+            if (retryLater(result, msg, [this, result, payload]() { sendOperate(result, payload); }))
             {
-                cout << "[s] " << msg << "\n";
+                return;
             }
-            else if (msg == "PROCESSING_COMPLETED")
+            why = "BUSY: server still saturated after " + to_string(busyTimeout.count() / 1000) + " s";
+        }
+        shared_ptr<promise<OperationResult>> p;
+        {
+            lock_guard<mutex> lock(mtx);
+            p = move(tasks[result].operation);
+        }
+        if (p)
+        {
+            p->set_exception(make_exception_ptr(runtime_error(why)));
+        }
+        });
+}
+
+// MATRIX = [n][element type][bytes u64][cells]; T has to be the type the matrix was made of.
+template <typename T>
+future<vector<T>> MatrixClient::matrix(uint32_t task)
+{
+    return ask<vector<T>>(task, MSG_REQUEST_MATRIX, MSG_MATRIX, [](const string& msg)
+        {
+        size_t pos = 0;
+        size_t n = getU32(msg, pos);
+        if (getU32(msg, pos) != elementTypeOf<T>())
+        {
+            throw runtime_error("matrix has a different element type");
+        }
+        if (getU64(msg, pos) != n * n * sizeof(T) || msg.size() - pos < n * n * sizeof(T))
+        {
+            throw runtime_error("truncated payload");
+        }
+        vector<T> cells(n * n);
+        for (size_t k = 0; k < cells.size(); ++k)
+        {
+            cells[k] = getCell<T>(msg.data() + pos + k * sizeof(T));
+        }
+        return cells;
+        });
+}
+
+// Drops the task on both sides; a pending run() fails with "discarded".
+void MatrixClient::discard(uint32_t task)
+{
+    failRun(task, "discarded");
+    {
+        lock_guard<mutex> sendLock(sendMtx);
+        FrameBatch batch;
+        batch.add(MSG_DISCARD_TASK, task);
+        batch.flush(sock);
+        lock_guard<mutex> lock(mtx);
+        auto it = tasks.find(task);
+        if (it != tasks.end())
+        {
+            // replies to requests sent before the discard are still on their way
+            it->second.discarded = true;
+            if (it->second.replies.empty())
             {
-                cout << "[s] " << msg << "\n";
-                done = true;
+                tasks.erase(it);
             }
-            else if (msg.rfind("RESULT:", 0) == 0)
+        }
+    }
+}
+
+void MatrixClient::readLoop()
+{
+    FrameReader in{ sock };
+    uint8_t type;
+    uint32_t id;
+    string msg;
+    try
+    {
+        while (in.read(type, id, msg))
+        {
+            size_t pos = 0;
+            if (type == MSG_MATRIX)
             {
-                finalResult = msg;          
-                resultReady = true;
-                break;
+                // the cells are not part of the frame; they go to the handler with it
+                pos = 8;
+                if (!in.readBody(msg, getU64(msg, pos)))
+                {
+                    break;
+                }
+                pos = 0;
             }
-            else 
+            if (type == MSG_INFO)
             {
-                cout << "[s] " << msg << "\n";
+                int thr = getU32(msg, pos);
+                double seconds = getF64(msg, pos);
+                {
+                    lock_guard<mutex> lock(mtx);
+                    auto it = tasks.find(id);
+                    if (it == tasks.end() || !it->second.run)
+                    {
+                        continue;
+                    }
+                    it->second.partial.seconds.emplace_back(thr, seconds);
+                }
+                if (onInfo)
+                {
+                    onInfo(id, thr, seconds);
+                }
+            }
+            else if (type == MSG_PROGRESS)
+            {
+                TaskProgress pr;
+                pr.cfgIdx = getU32(msg, pos);
+                pr.cfgTotal = getU32(msg, pos);
+                pr.rows = getU32(msg, pos);
+                pr.rowsTotal = getU32(msg, pos);
+                pr.rate = getF64(msg, pos);
+                pr.eta = getF64(msg, pos);
+                if (onProgress)
+                {
+                    onProgress(id, pr);
+                }
+            }
+            else if (type == MSG_OPERATION_DONE)
+            {
+                OperationResult result;
+                result.op = getU32(msg, pos);
+                result.n = getU32(msg, pos);
+                result.seconds = getF64(msg, pos);
+                shared_ptr<promise<OperationResult>> p;
+                {
+                    lock_guard<mutex> lock(mtx);
+                    auto it = tasks.find(id);
+                    if (it == tasks.end() || !it->second.operation)
+                    {
+                        continue;
+                    }
+                    p = move(it->second.operation);
+                    it->second.n = result.n;
+                }
+                p->set_value(result);
+            }
+            else if (type == MSG_PROCESSING_COMPLETED)
+            {
+                shared_ptr<promise<TaskResult>> p;
+                TaskResult result;
+                {
+                    lock_guard<mutex> lock(mtx);
+                    auto it = tasks.find(id);
+                    if (it == tasks.end() || !it->second.run)
+                    {
+                        continue;
+                    }
+                    p = move(it->second.run);
+                    result = move(it->second.partial);
+                }
+                p->set_value(move(result));
+            }
+            else
+            {
+                ReplyHandler handler;
+                {
+                    lock_guard<mutex> lock(mtx);
+                    auto it = tasks.find(id);
+                    if (it == tasks.end() || it->second.replies.empty())
+                    {
+                        cerr << "unsolicited message type " << int(type) << " for task " << id << "\n";
+                        continue;
+                    }
+                    handler = move(it->second.replies.front());
+                    it->second.replies.pop_front();
+                    if (it->second.discarded && it->second.replies.empty())
+                    {
+                        tasks.erase(it);
+                    }
+                }
+                handler(type, msg);
             }
         }
-        });
+    }
+    catch (const exception& e)
+    {
+        cerr << "bad frame: " << e.what() << "\n";
+    }
 
-    cout << "Press <Enter> to request status…\n";
-    cin.get();
-    while (!done)
+    unordered_map<uint32_t, TaskState> orphaned;
+    {
+        lock_guard<mutex> lock(mtx);
+        connected = false;
+        orphaned.swap(tasks);
+    }
+    for (auto& kv : orphaned)
     {
-        cin.get();
-        sendCommand(sock, "REQUEST_STATUS");
+        for (auto& handler : kv.second.replies)
+        {
+            handler(MSG_ERROR, "connection lost");
+        }
+        if (kv.second.run)
+        {
+            kv.second.run->set_exception(make_exception_ptr(runtime_error("connection lost")));
+        }
+        if (kv.second.operation)
+        {
+            kv.second.operation->set_exception(make_exception_ptr(runtime_error("connection lost")));
+        }
     }
+}
 
-    sendCommand(sock, "REQUEST_RESULTS");
-    while (!resultReady)
+void MatrixClient::timerLoop()
+{
+    unique_lock<mutex> lock(timerMtx);
+    while (!stopping)
     {
-        this_thread::sleep_for(chrono::milliseconds(10));
+        if (retries.empty())
+        {
+            timerCv.wait(lock);
+            continue;
+        }
+        auto due = retries.begin()->first;
+        if (steady_clock::now() < due)
+        {
+            timerCv.wait_until(lock, due);
+            continue;
+        }
+        function<void()> resend = move(retries.begin()->second);
+        retries.erase(retries.begin());
+        lock.unlock();
+        resend();
+        lock.lock();
+    }
+}
+
+// --op: uploads the operands, runs the operation once per thread count and
+// spot-checks the last result against the same cells computed here.
+template <typename T>
+int runOperation(MatrixClient& client, uint32_t op, int n, const vector<int>& cfg)
+{
+    int count = op == OP_MULTIPLY ? 2 : 1;
+    vector<vector<T>> local(count);
+    vector<uint32_t> operands;
+    try
+    {
+        for (int k = 0; k < count; ++k)
+        {
+            vector<T>& copy = local[k];
+            operands.push_back(client.createTask());
+            client.upload<T>(operands.back(), n, { 1 }, [&copy](T* cells, size_t total)
+                {
+                copy.resize(total);
+                for (size_t c = 0; c < total; ++c)
+                {
+                    cells[c] = copy[c] = static_cast<T>(rand() % 1000);
+                }
+                }).get();
+            cout << "[s] MATRIX_RECEIVED\n";
+        }
+
+        const char* name = op == OP_MULTIPLY ? "MULTIPLY" : "TRANSPOSE";
+        ostringstream report;
+        report << "RESULT:\n" << name << " " << n << "x" << n;
+        uint32_t result = 0;
+        for (int threads : cfg)
+        {
+            if (result != 0)
+            {
+                client.discard(result);
+            }
+            result = client.createTask();
+            OperationResult r = client.operate(result, op, operands, threads).get();
+            cout << "[s] " << name << ": threads=" << threads << ",time=" << r.seconds << "\n";
+            report << "\n" << threads << " threads: " << r.seconds << " s";
+        }
+
+        vector<T> cells = client.matrix<T>(result).get();
+        bool ok = cells.size() == static_cast<size_t>(n) * n;
+        for (int probe = 0; ok && probe < 16; ++probe)
+        {
+            int i = rand() % n;
+            int j = rand() % n;
+            Wrap<T> want = 0;
+            if (op == OP_MULTIPLY)
+            {
+                for (int k = 0; k < n; ++k)
+                {
+                    want += static_cast<Wrap<T>>(local[0][static_cast<size_t>(i) * n + k]) * static_cast<Wrap<T>>(local[1][static_cast<size_t>(k) * n + j]);
+                }
+            }
+            else
+            {
+                want = static_cast<Wrap<T>>(local[0][static_cast<size_t>(j) * n + i]);
+            }
+            T got = cells[static_cast<size_t>(i) * n + j];
+            // float sums may be rounded in a different order than here
+            ok = is_floating_point<T>::value ? fabs(static_cast<double>(got) - static_cast<double>(want)) <= 1e-4 * fabs(static_cast<double>(want))
+                : got == static_cast<T>(want);
+        }
+        report << "\nspot check: " << (ok ? "ok" : "MISMATCH");
+        cout << "\n===== RESULTS =====\n" << report.str() << "\n";
+        return ok ? 0 : 1;
+    }
+    catch (const exception& e)
+    {
+        cout << "[s] ERROR: " << e.what() << "\n";
+        return 1;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    string unixPath = DEFAULT_UNIX_PATH;
+    int jobs = 1;
+    uint32_t attachJob = 0;
+    uint32_t op = 0;
+    uint32_t elemType = ELEM_INT32;
+    int busyTimeoutSec = 120;   // give up on a saturated server after this long
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--tcp")
+        {
+            unixPath.clear();
+        }
+        else if (arg == "--unix" && i + 1 < argc)
+        {
+            unixPath = argv[++i];
+        }
+        else if (arg == "--jobs" && i + 1 < argc)
+        {
+            jobs = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--op" && i + 1 < argc)
+        {
+            string name = argv[++i];
+            op = name == "multiply" ? static_cast<uint32_t>(OP_MULTIPLY) : name == "transpose" ? OP_TRANSPOSE : 0u;
+            if (op == 0)
+            {
+                cerr << "unknown operation " << name << "\n";
+                return 1;
+            }
+        }
+        else if (arg == "--type" && i + 1 < argc)
+        {
+            string name = argv[++i];
+            elemType = name == "int16" ? static_cast<uint32_t>(ELEM_INT16) : name == "int32" ? ELEM_INT32
+                : name == "int64" ? ELEM_INT64 : name == "float" ? ELEM_FLOAT : 0u;
+            if (elemType == 0)
+            {
+                cerr << "unknown element type " << name << "\n";
+                return 1;
+            }
+        }
+        else if (arg == "--attach" && i + 1 < argc)
+        {
+            attachJob = static_cast<uint32_t>(atoi(argv[++i]));
+        }
+        else if (arg == "--busy-timeout" && i + 1 < argc)
+        {
+            busyTimeoutSec = max(0, atoi(argv[++i]));
+        }
+        else
+        {
+            cerr << "usage: client2 [--tcp | --unix PATH] [--jobs K | --attach JOB | --op multiply|transpose] [--type int16|int32|int64|float] [--busy-timeout SEC]\n";
+            return 1;
+        }
+    }
+
+#ifdef _WIN32
+    WSADATA wd{};
+    WSAStartup(MAKEWORD(2, 2), &wd);
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    MatrixClient client;
+    client.busyTimeout = seconds(busyTimeoutSec);
+    if (!client.connect(unixPath))
+    {
+        cerr << "Cannot connect to server\n";
+        return 1;
+    }
+
+    // with several jobs every line says which one it is about
+    auto tag = [jobs](uint32_t task)
+        {
+        return jobs == 1 ? string("[s] ") : "[s #" + to_string(task) + "] ";
+        };
+    mutex outMtx;
+    client.onStarted = [&](uint32_t task)
+        {
+        lock_guard<mutex> lock(outMtx);
+        cout << tag(task) << "PROCESSING_STARTED\n";
+        };
+    client.onInfo = [&](uint32_t task, int thr, double seconds)
+        {
+        lock_guard<mutex> lock(outMtx);
+        cout << tag(task) << "INFO: threads=" << thr << ",time=" << seconds << "\n";
+        };
+    client.onProgress = [&](uint32_t task, const TaskProgress& pr)
+        {
+        lock_guard<mutex> lock(outMtx);
+        cout << tag(task) << "progress " << pr.cfgIdx << "/" << pr.cfgTotal << ": rows " << pr.rows << "/" << pr.rowsTotal
+            << ", " << static_cast<long long>(pr.rate) << " rows/s, eta " << pr.eta << " s\n";
+        };
+    client.onBusy = [&](uint32_t task, uint32_t retryAfterMs)
+        {
+        lock_guard<mutex> lock(outMtx);
+        cout << tag(task) << "BUSY, retrying in " << retryAfterMs << " ms\n";
+        };
+
+    try
+    {
+        client.hello().get();
+        cout << "[s] WELCOME\n";
+    }
+    catch (const exception& e)
+    {
+        cout << "[s] unexpected reply: " << e.what() << "\n";
+    }
+
+    if (attachJob != 0)
+    {
+        // a job stored by an earlier connection: show where it is and what it has so far
+        uint32_t task = client.createTask();
+        try
+        {
+            client.attach(task, attachJob).get();
+            TaskStatus st = client.status(task).get();
+            cout << "[s] job " << attachJob << " — " << (st.state == 0 ? "FINISHED" : st.state == 1 ? "RUNNING" : "QUEUED")
+                << " " << st.done << "/" << st.total << "\n";
+            TaskResult r = client.results(task).get();
+            cout << "\n===== RESULTS =====\nRESULT:\nMatrix " << r.n << "x" << r.n;
+            for (auto& entry : r.seconds)
+            {
+                cout << "\n" << entry.first << " threads: " << entry.second << " s";
+            }
+            cout << "\n";
+        }
+        catch (const exception& e)
+        {
+            cout << "[s] ERROR: " << e.what() << "\n";
+        }
+        client.close();
+        return 0;
+    }
+
+    cout << "Matrix size: ";
+    int n; cin >> n;
+
+    cout << "Enter thread counts (space‑separated, empty = default 1 2 4 8 16 32): ";
+    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+    string line; getline(cin, line);
+    vector<int> cfg;
+    istringstream iss(line);
+    int t;
+    while (iss >> t)
+    {
+        if (t > 0)
+        {
+            cfg.push_back(t);
+        }
+    }
+    if (cfg.empty())
+    {
+        cfg = { 1, 2, 4, 8, 16, 32 };
+    }
+
+    if (op != 0)
+    {
+        int status = 1;
+        withElementType(elemType, [&](auto zero)
+            {
+            status = runOperation<decltype(zero)>(client, op, n, cfg);
+            });
+        client.close();
+        return status;
+    }
+
+    // all uploads go out before the first reply is awaited
+    vector<uint32_t> ids;
+    vector<future<uint32_t>> uploads;
+    withElementType(elemType, [&](auto zero)
+        {
+        typedef decltype(zero) T;
+        auto fill = [](T* cells, size_t count)
+            {
+            for (size_t k = 0; k < count; ++k)
+            {
+                cells[k] = static_cast<T>(rand() % 1000);
+            }
+            };
+        for (int j = 0; j < jobs; ++j)
+        {
+            ids.push_back(client.createTask());
+            uploads.push_back(client.upload<T>(ids.back(), n, cfg, fill));
+        }
+        });
+    vector<future<TaskResult>> runs(jobs);
+    for (int j = 0; j < jobs; ++j)
+    {
+        try
+        {
+            uint32_t jobId = uploads[j].get();
+            {
+                lock_guard<mutex> lock(outMtx);
+                cout << tag(ids[j]) << "MATRIX_RECEIVED";
+                if (jobId != 0)
+                {
+                    cout << " (stored as job " << jobId << ")";
+                }
+                cout << "\n";
+            }
+            runs[j] = client.run(ids[j], 250);
+        }
+        catch (const exception& e)
+        {
+            lock_guard<mutex> lock(outMtx);
+            cout << tag(ids[j]) << "ERROR: " << e.what() << "\n";
+        }
+    }
+
+    vector<string> reports(jobs);
+    for (int j = 0; j < jobs; ++j)
+    {
+        if (!runs[j].valid())
+        {
+            continue;
+        }
+        try
+        {
+            runs[j].get();
+            {
+                lock_guard<mutex> lock(outMtx);
+                cout << tag(ids[j]) << "PROCESSING_COMPLETED\n";
+            }
+            TaskResult r = client.results(ids[j]).get();
+            ostringstream report;
+            report << "RESULT:\nMatrix " << r.n << "x" << r.n;
+            for (auto& entry : r.seconds)
+            {
+                report << "\n" << entry.first << " threads: " << entry.second << " s";
+            }
+            // the sums come back in the width of the element type
+            withElementType(elemType, [&](auto zero)
+                {
+                auto diag = client.diagonal<decltype(zero)>(ids[j]).get();
+                report << "\ndiagonal:";
+                for (size_t k = 0; k < min<size_t>(diag.size(), 4); ++k)
+                {
+                    report << " " << diag[k];
+                }
+                if (diag.size() > 4)
+                {
+                    report << " ... " << diag.back();
+                }
+                });
+            reports[j] = report.str();
+        }
+        catch (const exception& e)
+        {
+            reports[j] = e.what();
+        }
     }
-    listener.join();
 
     cout << "\n===== RESULTS =====\n";
-    cout << finalResult << "\n";
+    for (int j = 0; j < jobs; ++j)
+    {
+        if (jobs > 1)
+        {
+            cout << "--- job " << ids[j] << " ---\n";
+        }
+        cout << (reports[j].empty() ? "upload failed" : reports[j]) << "\n";
+    }
 
-    closesocket(sock);
+    client.close();
+#ifdef _WIN32
     WSACleanup();
+#endif
     return 0;
 }
@@ -1,46 +1,57 @@
 #include <iostream>
 #include <vector>
 #include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <iomanip>
+#include <string>
 #include <thread>
+#include <type_traits>
 
 using namespace std;
 
-void generateMatrix(vector<vector<int>>& matrix, int size) //one thread function
+// Row sums are wider than the cells (64-bit for integers, double for float), so
+// they go to a separate diagonal vector instead of overflowing matrix[i][i].
+template <typename T>
+using Accumulator = typename conditional<is_floating_point<T>::value, double, int64_t>::type;
+
+template <typename T>
+void generateMatrix(vector<vector<T>>& matrix, vector<Accumulator<T>>& diagonal, int size) //one thread function
 {
     for (int i = 0; i < size; i++)
         {
-        int evenSum = 0;
+        Accumulator<T> evenSum = 0;
         for (int j = 0; j < size; j++)
             {
-            matrix[i][j] = rand() % 100;
+            matrix[i][j] = static_cast<T>(rand() % 100);
             if (j % 2 == 0)
                 {
                 evenSum += matrix[i][j];
             }
         }
-        matrix[i][i] = evenSum;
+        diagonal[i] = evenSum;
     }
 }
 
-void HelpgenerateMatrixMulti(vector<vector<int>>& matrix, int start, int end, int size)
+template <typename T>
+void HelpgenerateMatrixMulti(vector<vector<T>>& matrix, vector<Accumulator<T>>& diagonal, int start, int end, int size)
 {
     for (int i = start; i < end; i++)
         {
-        int evenSum = 0;
+        Accumulator<T> evenSum = 0;
         for (int j = 0; j < size; j++)
             {
-            matrix[i][j] = rand() % 100;
+            matrix[i][j] = static_cast<T>(rand() % 100);
             if (j % 2 == 0) {
                 evenSum += matrix[i][j];
             }
         }
-        matrix[i][i] = evenSum;
+        diagonal[i] = evenSum;
     }
 }
 
-void generateMatrixMulti(vector<vector<int>>& matrix, int size, int m) // Multi-thread function
+template <typename T>
+void generateMatrixMulti(vector<vector<T>>& matrix, vector<Accumulator<T>>& diagonal, int size, int m) // Multi-thread function
 {
     vector<thread> threads;
     int rows_num = size / m; //rows num for each thread
@@ -50,7 +61,7 @@ void generateMatrixMulti(vector<vector<int>>& matrix, int size, int m) // Multi-
     for (int t = 0; t < m; t++)
         {
         int end = start + rows_num + (t < remainder ? 1 : 0);
-        threads.emplace_back(HelpgenerateMatrixMulti, ref(matrix), start, end, size);
+        threads.emplace_back(HelpgenerateMatrixMulti<T>, ref(matrix), ref(diagonal), start, end, size);
         start = end;
     }
 
@@ -60,11 +71,12 @@ void generateMatrixMulti(vector<vector<int>>& matrix, int size, int m) // Multi-
     }
 }
 
-void printMatrix(const vector<vector<int>>& matrix)
+template <typename T>
+void printMatrix(const vector<vector<T>>& matrix)
 {
     for (const auto& row : matrix)
         {
-        for (int val : row)
+        for (T val : row)
             {
             cout << val << " ";
         }
@@ -72,19 +84,20 @@ void printMatrix(const vector<vector<int>>& matrix)
     }
 }
 
-int main()
+template <typename T>
+void run()
 {
-    //srand(time(NULL));
     vector<int> thread_counts = {3, 6, 12, 24, 48, 96}; // *0.5, *1, *2, *4,*8,*16
     vector<int> matrix_sizes = {100, 500, 1000, 2000, 5000, 10000};
 
     for (int size : matrix_sizes)
         {
         cout << "\nMatrix size: " << size << "\n";
-        vector<vector<int>> matrix(size, vector<int>(size));
+        vector<vector<T>> matrix(size, vector<T>(size));
+        vector<Accumulator<T>> diagonal(size);
 
         auto start_time = chrono::high_resolution_clock::now();
-        generateMatrix(matrix, size);
+        generateMatrix(matrix, diagonal, size);
         auto end_time = chrono::high_resolution_clock::now();
         chrono::duration<double> ex1_time = end_time - start_time;
 
@@ -92,15 +105,44 @@ int main()
 
         for (int m : thread_counts)
             {
-            vector<vector<int>> matrix_multi(size, vector<int>(size));
+            vector<vector<T>> matrix_multi(size, vector<T>(size));
+            vector<Accumulator<T>> diagonal_multi(size);
             start_time = chrono::high_resolution_clock::now();
-            generateMatrixMulti(matrix_multi, size, m);
+            generateMatrixMulti(matrix_multi, diagonal_multi, size, m);
             end_time = chrono::high_resolution_clock::now();
             chrono::duration<double> exm_time = end_time - start_time;
 
             cout << "Parallel Execution Time (" << m << " threads): " << fixed << setprecision(6) << exm_time.count() << " seconds" << endl;
         }
     }
+}
+
+int main(int argc, char* argv[])
+{
+    //srand(time(NULL));
+    string type = argc > 1 ? argv[1] : "int32"; // int16 | int32 | int64 | float
+    cout << "Element type: " << type << "\n";
+    if (type == "int16")
+        {
+        run<int16_t>();
+    }
+    else if (type == "int32")
+        {
+        run<int32_t>();
+    }
+    else if (type == "int64")
+        {
+        run<int64_t>();
+    }
+    else if (type == "float")
+        {
+        run<float>();
+    }
+    else
+        {
+        cerr << "usage: lab1 [int16|int32|int64|float]\n";
+        return 1;
+    }
 
     return 0;
 }
@@ -8,6 +8,7 @@
 #include <atomic>
 #include <random>
 #include <limits>
+#include <algorithm>
 
 using namespace std;
 
@@ -117,6 +118,207 @@ void parallel_find_atomic(atomic<int> &count, atomic<int> &min_negative, int num
     }
 }
 
+// Count and minimum of the negatives, kept per chunk of arr with a segment tree
+// over the chunks. An append or a point update refreshes one chunk and its
+// O(log n) tree path; a query reads O(log n) tree nodes plus at most two partial
+// chunks at the ends of the range. Every change to arr must go through here.
+const int CHUNK_SIZE = 1024;
+
+struct NegativeSummary
+{
+    int count = 0;
+    int min_negative = INT_MAX;
+};
+
+NegativeSummary merge_summary(const NegativeSummary &a, const NegativeSummary &b)
+{
+    NegativeSummary r;
+    r.count = a.count + b.count;
+    r.min_negative = min(a.min_negative, b.min_negative);
+    return r;
+}
+
+class NegativeIndex
+{
+public:
+    // after arr was filled from scratch
+    void rebuild()
+    {
+        chunks = (arr.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        leaves = 1;
+        while (leaves < max<size_t>(chunks, 1))
+        {
+            leaves *= 2;
+        }
+        tree.assign(2 * leaves, NegativeSummary());
+        for (size_t c = 0; c < chunks; ++c)
+        {
+            tree[leaves + c] = scan(c * CHUNK_SIZE, min(arr.size(), (c + 1) * CHUNK_SIZE));
+        }
+        for (size_t node = leaves - 1; node > 0; --node)
+        {
+            tree[node] = merge_summary(tree[2 * node], tree[2 * node + 1]);
+        }
+    }
+
+    void append(int value)
+    {
+        arr.push_back(value);
+        size_t c = (arr.size() - 1) / CHUNK_SIZE;
+        if (c >= leaves)
+        {
+            // tree is full: double it, which amortizes to O(1) per append
+            rebuild();
+            return;
+        }
+        chunks = c + 1;
+        NegativeSummary &leaf = tree[leaves + c];
+        if (value < 0)
+        {
+            leaf.count++;
+            leaf.min_negative = min(leaf.min_negative, value);
+            refresh(c);
+        }
+    }
+
+    void update(size_t i, int value)
+    {
+        arr[i] = value;
+        size_t c = i / CHUNK_SIZE;
+        tree[leaves + c] = scan(c * CHUNK_SIZE, min(arr.size(), (c + 1) * CHUNK_SIZE));
+        refresh(c);
+    }
+
+    NegativeSummary query() const
+    {
+        return tree[1];
+    }
+
+    // over arr[begin, end)
+    NegativeSummary query(size_t begin, size_t end) const
+    {
+        size_t first = (begin + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        size_t last = end / CHUNK_SIZE;
+        if (first >= last)
+        {
+            return scan(begin, end);
+        }
+        NegativeSummary r = merge_summary(scan(begin, first * CHUNK_SIZE), scan(last * CHUNK_SIZE, end));
+        for (size_t lo = first + leaves, hi = last + leaves; lo < hi; lo /= 2, hi /= 2)
+        {
+            if (lo & 1)
+            {
+                r = merge_summary(r, tree[lo++]);
+            }
+            if (hi & 1)
+            {
+                r = merge_summary(r, tree[--hi]);
+            }
+        }
+        return r;
+    }
+
+private:
+    size_t chunks = 0;
+    size_t leaves = 1;
+    vector<NegativeSummary> tree;   // 1 = root, leaves + c = chunk c
+
+    static NegativeSummary scan(size_t begin, size_t end)
+    {
+        NegativeSummary r;
+        for (size_t i = begin; i < end; ++i)
+        {
+            if (arr[i] < 0)
+            {
+                r.count++;
+                r.min_negative = min(r.min_negative, arr[i]);
+            }
+        }
+        return r;
+    }
+
+    void refresh(size_t c)
+    {
+        for (size_t node = (leaves + c) / 2; node > 0; node /= 2)
+        {
+            tree[node] = merge_summary(tree[2 * node], tree[2 * node + 1]);
+        }
+    }
+};
+
+// Appends and point updates, each followed by a full-array query: answered by the
+// index vs. rescanned with sequential_find. Range queries are checked against a scan.
+void incremental_benchmark(int rounds)
+{
+    static mt19937 gen(random_device{}());
+    uniform_int_distribution<int> dist(-1000000, 1000000);
+    vector<pair<int, int>> ops(rounds);
+    for (auto &op : ops)
+    {
+        op = { dist(gen), dist(gen) };
+    }
+    vector<int> original = arr;
+
+    int scan_count = 0, scan_min = 0;
+    auto start = chrono::high_resolution_clock::now();
+    for (int r = 0; r < rounds; ++r)
+    {
+        if (r % 2 == 0)
+        {
+            arr.push_back(ops[r].first);
+        }
+        else
+        {
+            arr[static_cast<unsigned>(ops[r].second) % arr.size()] = ops[r].first;
+        }
+        sequential_find(scan_count, scan_min);
+    }
+    auto end = chrono::high_resolution_clock::now();
+    double rescan = chrono::duration<double>(end - start).count();
+
+    arr = original;
+    NegativeIndex index;
+    index.rebuild();
+    NegativeSummary total;
+    start = chrono::high_resolution_clock::now();
+    for (int r = 0; r < rounds; ++r)
+    {
+        if (r % 2 == 0)
+        {
+            index.append(ops[r].first);
+        }
+        else
+        {
+            index.update(static_cast<unsigned>(ops[r].second) % arr.size(), ops[r].first);
+        }
+        total = index.query();
+    }
+    end = chrono::high_resolution_clock::now();
+    double indexed = chrono::duration<double>(end - start).count();
+
+    bool ok = total.count == scan_count && total.min_negative == scan_min;
+    uniform_int_distribution<size_t> pos(0, arr.size());
+    for (int q = 0; ok && q < 100; ++q)
+    {
+        size_t a = pos(gen), b = pos(gen);
+        NegativeSummary got = index.query(min(a, b), max(a, b));
+        int count = 0, min_negative = INT_MAX;
+        for (size_t i = min(a, b); i < max(a, b); ++i)
+        {
+            if (arr[i] < 0)
+            {
+                count++;
+                min_negative = min(min_negative, arr[i]);
+            }
+        }
+        ok = got.count == count && got.min_negative == min_negative;
+    }
+    cout << "Incremental - " << rounds << " appends/updates, query after each - Rescan: " << fixed << setprecision(6) << rescan
+         << " sec, Indexed: " << indexed << " sec\n"
+         << "Negative count: " << total.count << ", Minimum negative: " << total.min_negative << (ok ? "" : "  MISMATCH") << "\n\n";
+    arr = original;
+}
+
 int main()
 {
     srand(time(NULL));
@@ -136,6 +338,8 @@ int main()
              << fixed << setprecision(6) << chrono::duration<double>(end - start).count() << " sec\n"
              << "Negative count: " << seq_count << ", Minimum negative: " << seq_min << "\n\n";
 
+        incremental_benchmark(1000);
+
         for (int num_threads : THREAD_COUNTS)
         {
             int mtx_count, mtx_min;
@@ -10,12 +10,103 @@
 #include <memory>
 #include <atomic>
 #include <limits>
+#include <string>
+#include <fstream>
+#include <iomanip>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 using namespace std;
 using namespace std::chrono;
 
 mutex cout_mutex;
 
+// Трасування (--trace FILE): кожен потік пише у власний кільцевий буфер останніх
+// TRACE_RING_EVENTS подій з міткою TSC, без блокувань. Після тесту буфери
+// записуються у форматі Chrome Trace Event JSON (Perfetto, chrome://tracing).
+const size_t TRACE_RING_EVENTS = 1 << 14;
+
+struct TraceEvent
+{
+    uint64_t tsc;
+    const char* name;
+    const char* argName;
+    uint64_t arg;
+    uint32_t tid;
+    char phase; // 'B' початок, 'E' кінець, 'i' миттєва подія
+};
+
+struct TraceRing
+{
+    vector<TraceEvent> events = vector<TraceEvent>(TRACE_RING_EVENTS);
+    atomic<uint64_t> written{0};
+    uint32_t tid = 0;
+};
+
+atomic<bool> tracing{false};
+mutex traceMutex;
+vector<unique_ptr<TraceRing>> traceRings;
+uint64_t traceTsc0 = 0;
+steady_clock::time_point traceClock0;
+
+inline uint64_t readTsc()
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void traceEvent(char phase, const char* name, const char* argName = nullptr, uint64_t arg = 0)
+{
+    if (!tracing.load(memory_order_relaxed))
+    {
+        return;
+    }
+    thread_local TraceRing* ring = nullptr;
+    if (!ring)
+    {
+        lock_guard<mutex> lock(traceMutex);
+        traceRings.push_back(make_unique<TraceRing>());
+        ring = traceRings.back().get();
+        ring->tid = static_cast<uint32_t>(traceRings.size());
+    }
+    uint64_t k = ring->written.load(memory_order_relaxed);
+    ring->events[k % TRACE_RING_EVENTS] = {readTsc(), name, argName, arg, ring->tid, phase};
+    ring->written.store(k + 1, memory_order_release);
+}
+
+void dumpTrace(const string& file)
+{
+    lock_guard<mutex> lock(traceMutex);
+    double us = duration<double, micro>(steady_clock::now() - traceClock0).count();
+    double ticksPerUs = us > 0 ? (readTsc() - traceTsc0) / us : 1;
+    ofstream out(file);
+    out << fixed << setprecision(3) << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    const char* sep = "\n";
+    for (auto &ring : traceRings)
+    {
+        uint64_t end = ring->written.load(memory_order_acquire);
+        for (uint64_t k = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0; k < end; ++k)
+        {
+            const TraceEvent &e = ring->events[k % TRACE_RING_EVENTS];
+            out << sep << "{\"name\":\"" << e.name << "\",\"ph\":\"" << e.phase << "\",\"ts\":" << (e.tsc - traceTsc0) / ticksPerUs
+                << ",\"pid\":1,\"tid\":" << e.tid;
+            if (e.phase == 'i')
+                out << ",\"s\":\"t\"";
+            if (e.argName)
+                out << ",\"args\":{\"" << e.argName << "\":" << e.arg << "}";
+            out << "}";
+            sep = ",\n";
+        }
+    }
+    out << "\n]}\n";
+}
+
 class ThreadPool
 {
 public:
@@ -30,6 +121,8 @@ public:
     // immediate = true: миттєве завершення
     // immediate = false: плавне завершення
     void shutdown(bool immediate);
+    // чекає, доки робочі потоки завершать поточні задачі й вийдуть (після shutdown)
+    void join();
 
     void printMetrics();
 
@@ -81,6 +174,11 @@ ThreadPool::ThreadPool()
 ThreadPool::~ThreadPool()
 {
     shutdown(true);
+    join();
+}
+
+void ThreadPool::join()
+{
     for (auto &worker : workers)
     {
         if (worker.joinable())
@@ -95,9 +193,11 @@ void ThreadPool::workerFunction(int queueIndex)
     {
         unique_lock<mutex> lock(q.mtx);
         auto wait_start = steady_clock::now();
+        traceEvent('B', "wait", "queue", queueIndex);
         q.cv.wait(lock, [&]{
             return (!q.paused && !q.tasks.empty()) || (q.stop && q.tasks.empty());
         });
+        traceEvent('E', "wait");
         auto wait_end = steady_clock::now();
         {
             lock_guard<mutex> mlock(metricsMutex);
@@ -114,7 +214,9 @@ void ThreadPool::workerFunction(int queueIndex)
             q.tasks.pop();
             lock.unlock();
             auto task_start = steady_clock::now();
+            traceEvent('B', "task", "queue", queueIndex);
             task();
+            traceEvent('E', "task");
             auto task_end = steady_clock::now();
             totalTaskExecutionTime += duration_cast<microseconds>(task_end - task_start).count();
             ++totalTasksCompleted;
@@ -140,6 +242,7 @@ void ThreadPool::addTask(const function<void()>& task)
     {
         lock_guard<mutex> qlock(queues[minIndex]->mtx);
         queues[minIndex]->tasks.push(task);
+        traceEvent('i', "enqueue", "queue", minIndex);
         size_t currentLength = queues[minIndex]->tasks.size();
         queues[minIndex]->totalQueueLength += currentLength;
         ++queues[minIndex]->measurements;
@@ -252,8 +355,17 @@ void simulatedTask(int taskId)
     }
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    string traceFile;
+    if (argc == 3 && string(argv[1]) == "--trace")
+    {
+        traceFile = argv[2];
+        traceTsc0 = readTsc();
+        traceClock0 = steady_clock::now();
+        tracing = true;
+    }
+
     ThreadPool pool;
 
     auto testDuration = seconds(30);
@@ -302,6 +414,12 @@ int main()
         timerThread.join();
 
     pool.printMetrics();
+    if (!traceFile.empty())
+    {
+        // буфери читаються лише тоді, коли в них уже ніхто не пише
+        pool.join();
+        dumpTrace(traceFile);
+    }
 
     return 0;
 }
@@ -1,96 +1,1513 @@
-﻿#include <winsock2.h>
+﻿#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
 #include <ws2tcpip.h>
+#include <fcntl.h>
+#include <io.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define SD_SEND SHUT_WR
+#endif
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <thread>
-#pragma comment(lib, "ws2_32.lib")
+#include <unordered_map>
+#include <vector>
 
 #define PORT 8080
 #define ROOT "webroot"
+#define IDLE_TIMEOUT_MS 5000
+#define HEADER_TIMEOUT_MS 10000     // whole request head, however slowly it trickles in
+#define WRITE_TIMEOUT_MS 10000      // queued response with no write progress
+#define MAX_CONNECTIONS 10000
+#define ACCEPT_BATCH 64             // accepts per epoll round, after existing connections
+#define WHEEL_TICK_MS 100
+#define WHEEL_SLOTS 256
+#define MAX_REQUESTS_PER_CONN 1000
+#define MAX_HEADER_BYTES 8192
+#define MAX_HEADERS 32
+#define CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define CACHE_MAX_FILE_BYTES (4 * 1024 * 1024)
+#define REVALIDATE_MS 1000
+#define STREAM_CHUNK_BYTES (64 * 1024)
+#define LINGER_MS 2000              // unread request bytes drained after the last response
+#define LINGER_BYTES (1024 * 1024)
 
 using namespace std;
+using namespace std::chrono;
+namespace fs = std::filesystem;
+
+bool readAll(const string& path, string& out)
+{
+    ifstream in(path, ios::binary | ios::ate);
+    if (!in) return false;
+    out.resize((size_t)in.tellg());
+    in.seekg(0);
+    in.read(&out[0], out.size());
+    return (bool)in;
+}
+
+enum Encoding { IDENTITY, GZIP, BROTLI, ENCODING_COUNT };
+
+struct CachedFile
+{
+    string path;
+    Encoding encoding = IDENTITY;
+    bool exists = false;    // negative entries stop repeated stat() of absent .gz/.br siblings
+    string head;            // status line and entity headers, Connection and the blank line are added per reply
+    string notModified;     // prebuilt 304 head, same convention
+    string etag;
+    string lastModified;
+    string validators;      // ETag/Last-Modified/Vary lines shared by 200, 206 and 304
+    const char* contentType = nullptr;
+    string body;            // empty when the file is served from fd
+    int fd = -1;            // files too big for the cache stay open and are streamed from here
+    fs::file_time_type mtime;
+    uintmax_t size = 0;
+    steady_clock::time_point checked;
+
+    size_t bytes() const { return sizeof(CachedFile) + path.size() + head.size() + notModified.size() + body.size(); }
+
+    ~CachedFile()
+    {
+#ifdef _WIN32
+        if (fd >= 0) _close(fd);
+#else
+        if (fd >= 0) close(fd);
+#endif
+    }
+};
+
+const char* mimeType(string_view path)
+{
+    static const pair<const char*, const char*> types[] = {
+        { ".html", "text/html; charset=utf-8" }, { ".htm", "text/html; charset=utf-8" },
+        { ".css", "text/css" }, { ".js", "application/javascript" }, { ".json", "application/json" },
+        { ".txt", "text/plain; charset=utf-8" }, { ".xml", "application/xml" }, { ".svg", "image/svg+xml" },
+        { ".png", "image/png" }, { ".jpg", "image/jpeg" }, { ".jpeg", "image/jpeg" }, { ".gif", "image/gif" },
+        { ".webp", "image/webp" }, { ".ico", "image/x-icon" }, { ".pdf", "application/pdf" },
+        { ".woff", "font/woff" }, { ".woff2", "font/woff2" }, { ".wasm", "application/wasm" },
+        { ".mp4", "video/mp4" }, { ".webm", "video/webm" }, { ".mp3", "audio/mpeg" },
+    };
+    size_t dot = path.rfind('.');
+    if (dot != string_view::npos && path.find('/', dot) == string_view::npos)
+    {
+        string_view ext = path.substr(dot);
+        for (auto& t : types)
+        {
+            if (ext.size() == strlen(t.first) && equal(ext.begin(), ext.end(), t.first,
+                [](char a, char b) { return tolower((unsigned char)a) == b; }))
+            {
+                return t.second;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
 
-string readAll(const string& path) 
+string httpDate(fs::file_time_type ft)
 {
-    ifstream in(path, ios::binary);
-    if (!in) return {};
-    ostringstream ss;
-    ss << in.rdbuf();
-    return ss.str();
+    // C++17 has no clock_cast; translate through "now" on both clocks
+    auto sys = time_point_cast<system_clock::duration>(ft - fs::file_time_type::clock::now() + system_clock::now());
+    time_t t = system_clock::to_time_t(sys);
+    tm g{};
+#ifdef _WIN32
+    gmtime_s(&g, &t);
+#else
+    gmtime_r(&t, &g);
+#endif
+    char buf[64];
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &g);
+    return buf;
 }
 
-void reply(SOCKET s, int code, const string& body) 
+// Server-side metrics. Each epoll worker owns one WorkerStats and is its only
+// writer, so its relaxed atomic adds land on cache lines no other thread writes.
+// In blocking mode every session thread adds to slot 0; every update is an
+// atomic read-modify-write, so concurrent sessions only contend, never lose
+// counts. /metrics sums the slots when scraped.
+const double LATENCY_BOUNDS[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5 };
+const int LATENCY_BUCKETS = sizeof(LATENCY_BOUNDS) / sizeof(LATENCY_BOUNDS[0]) + 1;    // last one is +Inf
+const int STATUS_CODES[] = { 200, 206, 304, 400, 404, 405, 416, 431, 500, 503 };
+const int STATUS_COUNT = sizeof(STATUS_CODES) / sizeof(STATUS_CODES[0]);
+
+struct Histogram
 {
+    atomic<uint64_t> buckets[LATENCY_BUCKETS]{};
+    atomic<uint64_t> sumNs{ 0 };
+
+    void observe(steady_clock::duration d)
+    {
+        double sec = duration<double>(d).count();
+        int b = 0;
+        while (b < LATENCY_BUCKETS - 1 && sec > LATENCY_BOUNDS[b]) ++b;
+        buckets[b].fetch_add(1, memory_order_relaxed);
+        sumNs.fetch_add((uint64_t)duration_cast<nanoseconds>(d).count(), memory_order_relaxed);
+    }
+};
+
+struct alignas(64) WorkerStats
+{
+    atomic<uint64_t> requests{ 0 };
+    atomic<uint64_t> bytesSent{ 0 };
+    atomic<uint64_t> status[STATUS_COUNT + 1]{};    // last one counts any other code
+    atomic<uint64_t> cacheHits{ 0 };
+    atomic<uint64_t> cacheMisses{ 0 };
+    atomic<uint64_t> accepted{ 0 };
+    atomic<int64_t> activeConnections{ 0 };
+    Histogram firstByte;    // accept -> first response byte on the wire
+    Histogram total;        // request head received -> its response fully sent
+
+    void countStatus(int code)
+    {
+        int i = 0;
+        while (i < STATUS_COUNT && STATUS_CODES[i] != code) ++i;
+        status[i].fetch_add(1, memory_order_relaxed);
+    }
+};
+
+vector<unique_ptr<WorkerStats>> workerStats;    // sized in main before any worker starts
+thread_local WorkerStats* stats = nullptr;
+
+// Prometheus text exposition format, version 0.0.4.
+string renderMetrics()
+{
+    ostringstream out;
+    auto counter = [&](const char* name, const char* help, atomic<uint64_t> WorkerStats::* field)
+    {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n";
+        for (size_t w = 0; w < workerStats.size(); ++w)
+        {
+            out << name << "{worker=\"" << w << "\"} " << ((*workerStats[w]).*field).load(memory_order_relaxed) << "\n";
+        }
+    };
+    auto histogram = [&](const char* name, const char* help, Histogram WorkerStats::* field)
+    {
+        uint64_t buckets[LATENCY_BUCKETS] = {};
+        uint64_t sumNs = 0;
+        for (auto& ws : workerStats)
+        {
+            const Histogram& h = (*ws).*field;
+            for (int b = 0; b < LATENCY_BUCKETS; ++b) buckets[b] += h.buckets[b].load(memory_order_relaxed);
+            sumNs += h.sumNs.load(memory_order_relaxed);
+        }
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+        uint64_t cumulative = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; ++b)
+        {
+            cumulative += buckets[b];
+            out << name << "_bucket{le=\"";
+            if (b < LATENCY_BUCKETS - 1) out << LATENCY_BOUNDS[b];
+            else out << "+Inf";
+            out << "\"} " << cumulative << "\n";
+        }
+        out << name << "_sum " << sumNs / 1e9 << "\n" << name << "_count " << cumulative << "\n";
+    };
+
+    counter("lab5_requests_total", "Requests answered, including malformed ones.", &WorkerStats::requests);
+    counter("lab5_sent_bytes_total", "Response bytes written to sockets.", &WorkerStats::bytesSent);
+    counter("lab5_cache_hits_total", "File lookups answered without reading the disk.", &WorkerStats::cacheHits);
+    counter("lab5_cache_misses_total", "File lookups that loaded the file or found it missing.", &WorkerStats::cacheMisses);
+    counter("lab5_connections_accepted_total", "Connections accepted.", &WorkerStats::accepted);
+
+    out << "# HELP lab5_responses_total Responses by status code.\n# TYPE lab5_responses_total counter\n";
+    for (size_t w = 0; w < workerStats.size(); ++w)
+    {
+        for (int i = 0; i <= STATUS_COUNT; ++i)
+        {
+            out << "lab5_responses_total{worker=\"" << w << "\",code=\"";
+            if (i < STATUS_COUNT) out << STATUS_CODES[i];
+            else out << "other";
+            out << "\"} " << workerStats[w]->status[i].load(memory_order_relaxed) << "\n";
+        }
+    }
+
+    out << "# HELP lab5_active_connections Open client connections.\n# TYPE lab5_active_connections gauge\n";
+    for (size_t w = 0; w < workerStats.size(); ++w)
+    {
+        out << "lab5_active_connections{worker=\"" << w << "\"} " << workerStats[w]->activeConnections.load(memory_order_relaxed) << "\n";
+    }
+
+    histogram("lab5_first_byte_seconds", "Time from accept to the first response byte of a connection.", &WorkerStats::firstByte);
+    histogram("lab5_request_duration_seconds", "Time from a complete request head to the last byte of its response.", &WorkerStats::total);
+    return out.str();
+}
+
+// Keeps hot files in memory with their response heads prebuilt. An entry is
+// trusted for REVALIDATE_MS, after that one stat() decides whether to reload it.
+// Precompressed siblings (x.gz, x.br) are separate entries in their own index.
+class FileCache
+{
+public:
+    // `path` is the file on disk; for GZIP/BROTLI it is the sibling with the suffix
+    shared_ptr<const CachedFile> get(const string& path, Encoding encoding = IDENTITY);
+
+private:
+    mutex mtx;
+    size_t usedBytes = 0;
+    list<shared_ptr<CachedFile>> lru;   // front = most recently used
+    unordered_map<string, list<shared_ptr<CachedFile>>::iterator> index[ENCODING_COUNT];
+
+    shared_ptr<CachedFile> load(const string& path, Encoding encoding, fs::file_time_type mtime, uintmax_t size);
+    void insert(const shared_ptr<CachedFile>& file);
+};
+
+FileCache fileCache;
+
+shared_ptr<CachedFile> FileCache::load(const string& path, Encoding encoding, fs::file_time_type mtime, uintmax_t size)
+{
+    auto file = make_shared<CachedFile>();
+    file->path = path;
+    file->encoding = encoding;
+    file->exists = true;
+    if (size > CACHE_MAX_FILE_BYTES)
+    {
+#ifdef _WIN32
+        file->fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+        file->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+        if (file->fd < 0) return nullptr;
+    }
+    else if (!readAll(path, file->body)) return nullptr;
+    file->mtime = mtime;
+    file->size = file->fd >= 0 ? size : file->body.size();
+    file->checked = steady_clock::now();
+
+    ostringstream tag;
+    tag << '"' << hex << file->size << '-' << (unsigned long long)mtime.time_since_epoch().count() << '"';
+    file->etag = tag.str();
+    file->lastModified = httpDate(mtime);
+
+    // content type comes from the name without the compression suffix
+    string_view original(path);
+    if (encoding != IDENTITY) original.remove_suffix(3);   // ".gz" or ".br"
+
+    file->contentType = mimeType(original);
+
+    ostringstream validators;
+    validators << "ETag: " << file->etag << "\r\n"
+        << "Last-Modified: " << file->lastModified << "\r\n"
+        << "Vary: Accept-Encoding\r\n";
+    file->validators = validators.str();
+
+    ostringstream hdr;
+    hdr << "HTTP/1.1 200 OK\r\n"
+        << "Content-Type: " << file->contentType << "\r\n"
+        << "Content-Length: " << file->size << "\r\n"
+        << (encoding == GZIP ? "Content-Encoding: gzip\r\n" : encoding == BROTLI ? "Content-Encoding: br\r\n" : "")
+        << "Accept-Ranges: bytes\r\n"
+        << file->validators;
+    file->head = hdr.str();
+    file->notModified = "HTTP/1.1 304 Not Modified\r\n" + file->validators;
+    return file;
+}
+
+void FileCache::insert(const shared_ptr<CachedFile>& file)
+{
+    if (file->body.size() > CACHE_MAX_FILE_BYTES) return;
+    lock_guard<mutex> lock(mtx);
+    auto& idx = index[file->encoding];
+    auto it = idx.find(file->path);
+    if (it != idx.end())
+    {
+        usedBytes -= (*it->second)->bytes();
+        lru.erase(it->second);
+        idx.erase(it);
+    }
+    lru.push_front(file);
+    idx[file->path] = lru.begin();
+    usedBytes += file->bytes();
+    while (usedBytes > CACHE_MAX_BYTES && lru.size() > 1)
+    {
+        auto& victim = lru.back();
+        usedBytes -= victim->bytes();
+        index[victim->encoding].erase(victim->path);
+        lru.pop_back();
+    }
+}
+
+shared_ptr<const CachedFile> FileCache::get(const string& path, Encoding encoding)
+{
+    shared_ptr<CachedFile> cached;
+    {
+        lock_guard<mutex> lock(mtx);
+        auto& idx = index[encoding];
+        auto it = idx.find(path);
+        if (it != idx.end())
+        {
+            cached = *it->second;
+            lru.splice(lru.begin(), lru, it->second);
+            if (steady_clock::now() - cached->checked < milliseconds(REVALIDATE_MS))
+            {
+                stats->cacheHits.fetch_add(1, memory_order_relaxed);
+                return cached->exists ? cached : nullptr;
+            }
+        }
+    }
+
+    error_code ec;
+    auto status = fs::status(path, ec);
+    if (ec || !fs::is_regular_file(status))
+    {
+        if (!cached || cached->exists)
+        {
+            stats->cacheMisses.fetch_add(1, memory_order_relaxed);
+            auto missing = make_shared<CachedFile>();
+            missing->path = path;
+            missing->encoding = encoding;
+            missing->checked = steady_clock::now();
+            insert(missing);
+        }
+        else
+        {
+            stats->cacheHits.fetch_add(1, memory_order_relaxed);
+            lock_guard<mutex> lock(mtx);
+            cached->checked = steady_clock::now();
+        }
+        return nullptr;
+    }
+    auto mtime = fs::last_write_time(path, ec);
+    auto size = fs::file_size(path, ec);
+    if (cached && cached->exists && cached->mtime == mtime && cached->size == size)
+    {
+        stats->cacheHits.fetch_add(1, memory_order_relaxed);
+        lock_guard<mutex> lock(mtx);
+        cached->checked = steady_clock::now();
+        return cached;
+    }
+
+    stats->cacheMisses.fetch_add(1, memory_order_relaxed);
+    auto file = load(path, encoding, mtime, size);
+    if (file) insert(file);
+    return file;
+}
+
+// Positional read, safe while other connections stream the same descriptor.
+long long readAt(int fd, char* buf, size_t len, long long offset)
+{
+#ifdef _WIN32
+    OVERLAPPED ov{};
+    ov.Offset = (DWORD)(offset & 0xFFFFFFFF);
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD got = 0;
+    if (!ReadFile((HANDLE)_get_osfhandle(fd), buf, (DWORD)len, &got, &ov)) return -1;
+    return got;
+#else
+    return pread(fd, buf, len, (off_t)offset);
+#endif
+}
+
+bool wouldBlock()
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+// One piece of a queued response: bytes in memory or a range of an open file.
+// `file` keeps cached bytes and descriptors alive until the piece is on the wire.
+struct Segment
+{
+    shared_ptr<const CachedFile> file;
+    string own;
+    const char* data = nullptr;
+    size_t len = 0;
+    int fd = -1;
+    long long offset = 0;
+
+    // `own` may move with the vector, so owned bytes are addressed from its end
+    const char* ptr() const { return own.empty() ? data : own.data() + own.size() - len; }
+};
+
+// Response queue flushed with gather writes (writev / WSASend) and sendfile, so
+// cached bodies are never copied into an intermediate buffer. Handles partial
+// writes by advancing the front segment. The vector is reused between requests
+// so queueing a cached reply does not allocate.
+class Output
+{
+public:
+    void add(const char* data, size_t len, const shared_ptr<const CachedFile>& keep = nullptr)
+    {
+        if (len == 0) return;
+        queued += len;
+        Segment& seg = next();
+        seg.file = keep;
+        seg.data = data;
+        seg.len = len;
+    }
+
+    void addOwned(string bytes)
+    {
+        Segment& seg = next();
+        seg.own = move(bytes);
+        seg.len = seg.own.size();
+        queued += seg.len;
+    }
+
+    void addFile(const shared_ptr<const CachedFile>& file, long long offset, size_t len)
+    {
+        Segment& seg = next();
+        seg.file = file;
+        seg.fd = file->fd;
+        seg.offset = offset;
+        seg.len = len;
+        queued += len;
+    }
+
+    bool empty() const { return head == used; }
+
+    // running totals over the connection's lifetime; a response is fully on the
+    // wire once sentBytes() reaches the queuedBytes() seen right after queueing it
+    uint64_t queuedBytes() const { return queued; }
+    uint64_t sentBytes() const { return sent; }
+
+    // 1: everything sent, 0: socket full (a short write; on a blocking socket
+    // that means SO_SNDTIMEO expired), -1: error
+    int flush(SOCKET s);
+
+private:
+    vector<Segment> segs;
+    size_t head = 0;
+    size_t used = 0;
+    uint64_t queued = 0;
+    uint64_t sent = 0;
+    vector<char> chunk;     // bounded read-ahead for file segments where sendfile is not available
+    size_t chunkPos = 0;
+    size_t chunkLen = 0;
+
+    int flushChunk(SOCKET s, Segment& f);
+
+    Segment& next()
+    {
+        if (used == segs.size()) segs.emplace_back();
+        return segs[used++];
+    }
+
+    void release(Segment& seg)
+    {
+        seg.file.reset();
+        seg.own.clear();
+        seg.data = nullptr;
+        seg.len = 0;
+        seg.fd = -1;
+        seg.offset = 0;
+    }
+
+    void consume(size_t n)
+    {
+        sent += n;
+        while (n > 0)
+        {
+            Segment& f = segs[head];
+            size_t step = min(n, f.len);
+            f.len -= step;
+            if (f.fd >= 0) f.offset += step;
+            else if (f.own.empty()) f.data += step;
+            n -= step;
+            if (f.len == 0) release(segs[head++]);
+        }
+        while (head < used && segs[head].len == 0) release(segs[head++]);
+        if (head == used) head = used = 0;
+    }
+};
+
+// Streams a file segment through one STREAM_CHUNK_BYTES buffer, so memory per
+// download stays constant whatever the file size; a full socket simply leaves
+// the rest of the chunk for the next flush.
+int Output::flushChunk(SOCKET s, Segment& f)
+{
+    if (chunkPos == chunkLen)
+    {
+        if (chunk.empty()) chunk.resize(STREAM_CHUNK_BYTES);
+        long long got = readAt(f.fd, chunk.data(), min(chunk.size(), f.len), f.offset);
+        if (got <= 0) return -1;    // file shrank under us
+        chunkPos = 0;
+        chunkLen = (size_t)got;
+    }
+    size_t want = chunkLen - chunkPos;
+    int n = send(s, chunk.data() + chunkPos, (int)want, 0);
+    if (n < 0) return wouldBlock() ? 0 : -1;
+    chunkPos += n;
+    consume((size_t)n);
+    return (size_t)n < want ? 0 : 1;
+}
+
+int Output::flush(SOCKET s)
+{
+    const size_t MAX_IOV = 64;
+    while (head < used)
+    {
+        Segment& f = segs[head];
+        if (f.fd >= 0)
+        {
+#ifdef __linux__
+            // a short sendfile is not a full socket (one call moves at most ~2 GiB), and
+            // with edge-triggered epoll only EAGAIN is sure to be followed by EPOLLOUT,
+            // so keep going until the segment is sent or the call says EAGAIN
+            off_t off = (off_t)f.offset;
+            ssize_t n = sendfile(s, f.fd, &off, f.len);
+            if (n < 0) return wouldBlock() ? 0 : -1;
+            if (n == 0) return -1;  // file shrank under us
+            consume((size_t)n);
+#else
+            int r = flushChunk(s, f);
+            if (r <= 0) return r;
+#endif
+            continue;
+        }
+#ifdef _WIN32
+        WSABUF bufs[MAX_IOV];
+        DWORD count = 0;
+        for (size_t i = head; i < used && count < MAX_IOV && segs[i].fd < 0; ++i)
+        {
+            bufs[count].buf = (char*)segs[i].ptr();
+            bufs[count].len = (ULONG)segs[i].len;
+            ++count;
+        }
+        DWORD sent = 0;
+        if (WSASend(s, bufs, count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR)
+        {
+            return wouldBlock() ? 0 : -1;
+        }
+        size_t want = 0;
+        for (DWORD i = 0; i < count; ++i) want += bufs[i].len;
+        consume(sent);
+        if (sent < want) return 0;
+#else
+        iovec iov[MAX_IOV];
+        size_t count = 0;
+        for (size_t i = head; i < used && count < MAX_IOV && segs[i].fd < 0; ++i)
+        {
+            iov[count].iov_base = (void*)segs[i].ptr();
+            iov[count].iov_len = segs[i].len;
+            ++count;
+        }
+        size_t want = 0;
+        for (size_t i = 0; i < count; ++i) want += iov[i].iov_len;
+        ssize_t n = writev(s, iov, (int)count);
+        if (n < 0) return wouldBlock() ? 0 : -1;
+        consume((size_t)n);
+        if ((size_t)n < want) return 0;
+#endif
+    }
+    return 1;
+}
+
+const char KEEP_ALIVE[] = "Connection: keep-alive\r\n\r\n";
+const char CLOSE[] = "Connection: close\r\n\r\n";
+
+void reply(Output& out, int code, const string& body, bool keepAlive, bool withBody)
+{
+    stats->countStatus(code);
     string status = (code == 200 ? "200 OK" :
         code == 404 ? "404 Not Found" :
+        code == 400 ? "400 Bad Request" :
         code == 405 ? "405 Method Not Allowed" :
+        code == 416 ? "416 Range Not Satisfiable" :
+        code == 431 ? "431 Request Header Fields Too Large" :
         "500 Internal Server Error");
     ostringstream hdr;
     hdr << "HTTP/1.1 " << status << "\r\n"
         << "Content-Type: text/html\r\n"
         << "Content-Length: " << body.size() << "\r\n"
-        << "Connection: close\r\n\r\n";
-    string out = hdr.str() + body;
-    send(s, out.c_str(), (int)out.size(), 0);
+        << (keepAlive ? KEEP_ALIVE : CLOSE);
+    out.addOwned(withBody ? hdr.str() + body : hdr.str());
 }
 
-void session(SOCKET client) 
+void replyNotModified(Output& out, const shared_ptr<const CachedFile>& file, bool keepAlive)
 {
-    char buf[4096];
-    int n = recv(client, buf, sizeof(buf) - 1, 0);
-    if (n <= 0) 
-    { 
-        closesocket(client); return; 
+    stats->countStatus(304);
+    out.add(file->notModified.data(), file->notModified.size(), file);
+    if (keepAlive) out.add(KEEP_ALIVE, sizeof(KEEP_ALIVE) - 1);
+    else out.add(CLOSE, sizeof(CLOSE) - 1);
+}
+
+void replyFile(Output& out, const shared_ptr<const CachedFile>& file, bool keepAlive, bool withBody = true)
+{
+    stats->countStatus(200);
+    out.add(file->head.data(), file->head.size(), file);
+    if (keepAlive) out.add(KEEP_ALIVE, sizeof(KEEP_ALIVE) - 1);
+    else out.add(CLOSE, sizeof(CLOSE) - 1);
+    if (!withBody) return;
+    if (file->fd >= 0) out.addFile(file, 0, (size_t)file->size);
+    else out.add(file->body.data(), file->body.size(), file);
+}
+
+void replyRange(Output& out, const shared_ptr<const CachedFile>& file, unsigned long long first, unsigned long long last, bool keepAlive, bool withBody)
+{
+    stats->countStatus(206);
+    unsigned long long len = last - first + 1;
+    ostringstream hdr;
+    hdr << "HTTP/1.1 206 Partial Content\r\n"
+        << "Content-Type: " << file->contentType << "\r\n"
+        << "Content-Range: bytes " << first << "-" << last << "/" << file->size << "\r\n"
+        << "Content-Length: " << len << "\r\n"
+        << (file->encoding == GZIP ? "Content-Encoding: gzip\r\n" : file->encoding == BROTLI ? "Content-Encoding: br\r\n" : "")
+        << "Accept-Ranges: bytes\r\n"
+        << file->validators
+        << (keepAlive ? KEEP_ALIVE : CLOSE);
+    out.addOwned(hdr.str());
+    if (!withBody) return;
+    if (file->fd >= 0) out.addFile(file, (long long)first, (size_t)len);
+    else out.add(file->body.data() + first, (size_t)len, file);
+}
+
+void replyUnsatisfiable(Output& out, const CachedFile& file, bool keepAlive)
+{
+    stats->countStatus(416);
+    ostringstream hdr;
+    hdr << "HTTP/1.1 416 Range Not Satisfiable\r\n"
+        << "Content-Range: bytes */" << file.size << "\r\n"
+        << "Content-Length: 0\r\n"
+        << (keepAlive ? KEEP_ALIVE : CLOSE);
+    out.addOwned(hdr.str());
+}
+
+void replyMetrics(Output& out, bool keepAlive, bool withBody)
+{
+    stats->countStatus(200);
+    string body = renderMetrics();
+    ostringstream hdr;
+    hdr << "HTTP/1.1 200 OK\r\n"
+        << "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        << "Content-Length: " << body.size() << "\r\n"
+        << "Cache-Control: no-store\r\n"
+        << (keepAlive ? KEEP_ALIVE : CLOSE);
+    out.addOwned(hdr.str());
+    if (withBody) out.addOwned(move(body));
+}
+
+// SO_RCVTIMEO / SO_SNDTIMEO
+void setTimeout(SOCKET s, int option, int ms)
+{
+#ifdef _WIN32
+    DWORD timeout = ms;
+#else
+    timeval timeout{ ms / 1000, (ms % 1000) * 1000 };
+#endif
+    setsockopt(s, SOL_SOCKET, option, (const char*)&timeout, sizeof(timeout));
+}
+
+// Global connection cap shared by all workers. Over the cap a client gets this
+// canned reply straight after accept, before any buffer or thread is spent on it.
+atomic<int> openConnections{ 0 };
+int maxConnections = MAX_CONNECTIONS;
+const char OVERLOADED[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+
+bool admitConnection()
+{
+    if (openConnections.fetch_add(1, memory_order_relaxed) < maxConnections) return true;
+    openConnections.fetch_sub(1, memory_order_relaxed);
+    return false;
+}
+
+void rejectOverloaded(SOCKET s)
+{
+    stats->countStatus(503);
+    send(s, OVERLOADED, (int)(sizeof(OVERLOADED) - 1), 0);
+    closesocket(s);
+}
+
+struct HttpHeader
+{
+    string_view name;
+    string_view value;
+};
+
+bool equalsNoCase(string_view a, string_view b)
+{
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+    }
+    return true;
+}
+
+// true if the comma-separated header value lists `token`
+bool hasToken(string_view value, string_view token)
+{
+    while (!value.empty())
+    {
+        size_t comma = value.find(',');
+        string_view item = value.substr(0, comma);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) item.remove_prefix(1);
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) item.remove_suffix(1);
+        if (equalsNoCase(item, token)) return true;
+        if (comma == string_view::npos) break;
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// Accept-Encoding check honouring q=0 exclusions and the * wildcard.
+bool acceptsEncoding(string_view value, string_view coding)
+{
+    bool wildcard = false;
+    while (!value.empty())
+    {
+        size_t comma = value.find(',');
+        string_view item = value.substr(0, comma);
+        string_view params;
+        size_t semi = item.find(';');
+        if (semi != string_view::npos)
+        {
+            params = item.substr(semi + 1);
+            item = item.substr(0, semi);
+        }
+        while (!item.empty() && item.front() == ' ') item.remove_prefix(1);
+        while (!item.empty() && item.back() == ' ') item.remove_suffix(1);
+        size_t q = params.find("q=");
+        bool refused = q != string_view::npos && params.substr(q + 2).find_first_not_of("0. ") == string_view::npos;
+        if (equalsNoCase(item, coding)) return !refused;
+        if (item == "*") wildcard = !refused;
+        if (comma == string_view::npos) break;
+        value.remove_prefix(comma + 1);
+    }
+    return wildcard;
+}
+
+// A parsed request head. The views point into the connection's input buffer and
+// are only valid until the request has been handled.
+struct HttpRequest
+{
+    string_view method;
+    string_view target;
+    string_view version;
+    HttpHeader headers[MAX_HEADERS];
+    int headerCount = 0;
+
+    string_view header(string_view name) const
+    {
+        for (int i = 0; i < headerCount; ++i)
+        {
+            if (equalsNoCase(headers[i].name, name)) return headers[i].value;
+        }
+        return {};
     }
-    buf[n] = '\0';
 
-    string req(buf);
-    if (req.rfind("GET ", 0) != 0) 
+    // HTTP/1.1 keeps the connection unless told otherwise, HTTP/1.0 only on request.
+    bool keepAlive() const
     {
-        reply(client, 405, "<h1>405 Method Not Allowed</h1>");
-        closesocket(client);
-        return;
+        string_view conn = header("Connection");
+        if (hasToken(conn, "close")) return false;
+        if (hasToken(conn, "keep-alive")) return true;
+        return version == "HTTP/1.1";
     }
-    size_t pos = req.find(' ', 4);
-    string uri = req.substr(4, pos - 4);
+};
+
+// Incremental request-head parser. Each call continues where the previous one
+// stopped, so every byte is scanned once however the head was fragmented.
+// Positions are kept as offsets from the start of the request, which lets the
+// connection compact its buffer between reads; views are built only when the
+// head is complete. Nothing here allocates.
+class HttpParser
+{
+public:
+    enum Result { INCOMPLETE, DONE, FAILED };
+
+    HttpRequest request;
+    size_t headLength = 0;  // bytes of the finished head, including the blank line
+    int error = 0;          // status to answer with after FAILED
+
+    Result parse(const char* data, size_t len);
 
+    void reset()
+    {
+        state = REQUEST_LINE;
+        pos = lineStart = 0;
+        fieldCount = 0;
+        headLength = 0;
+        error = 0;
+    }
+
+private:
+    struct Span { uint32_t begin = 0, len = 0; };
+    enum State { REQUEST_LINE, HEADERS };
+
+    State state = REQUEST_LINE;
+    size_t pos = 0;
+    size_t lineStart = 0;
+    Span method, target, version;
+    Span names[MAX_HEADERS], values[MAX_HEADERS];
+    int fieldCount = 0;
+
+    Result fail(int status) { error = status; return FAILED; }
+    bool requestLine(const char* data, size_t begin, size_t end);
+    bool headerLine(const char* data, size_t begin, size_t end);
+};
+
+bool HttpParser::requestLine(const char* data, size_t begin, size_t end)
+{
+    const char* line = data + begin;
+    size_t len = end - begin;
+    const char* sp1 = (const char*)memchr(line, ' ', len);
+    if (!sp1) return false;
+    const char* sp2 = (const char*)memchr(sp1 + 1, ' ', line + len - sp1 - 1);
+    if (!sp2 || sp1 == line || sp2 == sp1 + 1) return false;
+
+    method = { (uint32_t)begin, (uint32_t)(sp1 - line) };
+    target = { (uint32_t)(sp1 + 1 - data), (uint32_t)(sp2 - sp1 - 1) };
+    version = { (uint32_t)(sp2 + 1 - data), (uint32_t)(line + len - sp2 - 1) };
+    return string_view(data + version.begin, version.len).substr(0, 7) == "HTTP/1.";
+}
+
+bool HttpParser::headerLine(const char* data, size_t begin, size_t end)
+{
+    const char* line = data + begin;
+    size_t len = end - begin;
+    if (line[0] == ' ' || line[0] == '\t') return false;     // obsolete line folding
+    const char* colon = (const char*)memchr(line, ':', len);
+    if (!colon || colon == line) return false;
+
+    size_t vb = colon + 1 - data;
+    size_t ve = end;
+    while (vb < ve && (data[vb] == ' ' || data[vb] == '\t')) ++vb;
+    while (ve > vb && (data[ve - 1] == ' ' || data[ve - 1] == '\t')) --ve;
+    names[fieldCount] = { (uint32_t)begin, (uint32_t)(colon - line) };
+    values[fieldCount] = { (uint32_t)vb, (uint32_t)(ve - vb) };
+    ++fieldCount;
+    return true;
+}
+
+HttpParser::Result HttpParser::parse(const char* data, size_t len)
+{
+    while (pos < len)
+    {
+        const char* nl = (const char*)memchr(data + pos, '\n', len - pos);
+        if (!nl)
+        {
+            pos = len;
+            break;
+        }
+        size_t lineEnd = nl - data;
+        pos = lineEnd + 1;
+        if (pos > MAX_HEADER_BYTES) return fail(431);
+        if (lineEnd > lineStart && data[lineEnd - 1] == '\r') --lineEnd;
+        size_t begin = lineStart;
+        lineStart = pos;
+
+        if (state == REQUEST_LINE)
+        {
+            if (lineEnd == begin) continue;     // tolerate stray CRLF between requests
+            if (!requestLine(data, begin, lineEnd)) return fail(400);
+            state = HEADERS;
+        }
+        else if (lineEnd == begin)
+        {
+            headLength = pos;
+            request.method = string_view(data + method.begin, method.len);
+            request.target = string_view(data + target.begin, target.len);
+            request.version = string_view(data + version.begin, version.len);
+            request.headerCount = fieldCount;
+            for (int i = 0; i < fieldCount; ++i)
+            {
+                request.headers[i].name = string_view(data + names[i].begin, names[i].len);
+                request.headers[i].value = string_view(data + values[i].begin, values[i].len);
+            }
+            return DONE;
+        }
+        else
+        {
+            if (fieldCount == MAX_HEADERS) return fail(431);
+            if (!headerLine(data, begin, lineEnd)) return fail(400);
+        }
+    }
+    if (len >= MAX_HEADER_BYTES) return fail(431);
+    return INCOMPLETE;
+}
+
+// If-None-Match takes precedence; If-Modified-Since is compared exactly against
+// our Last-Modified like nginx does by default.
+bool notModified(const HttpRequest& req, const CachedFile& file)
+{
+    string_view inm = req.header("If-None-Match");
+    if (!inm.empty())
+    {
+        if (inm == "*") return true;
+        while (!inm.empty())
+        {
+            size_t comma = inm.find(',');
+            string_view tag = inm.substr(0, comma);
+            while (!tag.empty() && tag.front() == ' ') tag.remove_prefix(1);
+            while (!tag.empty() && tag.back() == ' ') tag.remove_suffix(1);
+            if (tag.substr(0, 2) == "W/") tag.remove_prefix(2);
+            if (tag == file.etag) return true;
+            if (comma == string_view::npos) break;
+            inm.remove_prefix(comma + 1);
+        }
+        return false;
+    }
+    string_view ims = req.header("If-Modified-Since");
+    return !ims.empty() && ims == file.lastModified;
+}
+
+enum RangeResult { RANGE_NONE, RANGE_OK, RANGE_UNSATISFIABLE };
+
+// Single "bytes=a-b", "bytes=a-" or "bytes=-n" range. Multi-range and malformed
+// headers are ignored, which RFC 9110 allows, and the full body is sent.
+RangeResult parseRange(const HttpRequest& req, const CachedFile& file, unsigned long long& first, unsigned long long& last)
+{
+    string_view range = req.header("Range");
+    if (range.substr(0, 6) != "bytes=" || range.find(',') != string_view::npos) return RANGE_NONE;
+    string_view ifRange = req.header("If-Range");
+    if (!ifRange.empty() && ifRange != file.etag && ifRange != file.lastModified) return RANGE_NONE;
+
+    range.remove_prefix(6);
+    size_t dash = range.find('-');
+    if (dash == string_view::npos) return RANGE_NONE;
+    string_view a = range.substr(0, dash), b = range.substr(dash + 1);
+    auto number = [](string_view v, unsigned long long& out)
+    {
+        if (v.empty() || v.size() > 19) return false;
+        out = 0;
+        for (char ch : v)
+        {
+            if (ch < '0' || ch > '9') return false;
+            out = out * 10 + (ch - '0');
+        }
+        return true;
+    };
+
+    unsigned long long size = file.size;
+    if (a.empty())
+    {
+        unsigned long long suffix;
+        if (!number(b, suffix)) return RANGE_NONE;
+        if (suffix == 0 || size == 0) return RANGE_UNSATISFIABLE;
+        first = suffix >= size ? 0 : size - suffix;
+        last = size - 1;
+        return RANGE_OK;
+    }
+    if (!number(a, first)) return RANGE_NONE;
+    if (b.empty()) last = size - 1;
+    else if (!number(b, last) || last < first) return RANGE_NONE;
+    if (first >= size) return RANGE_UNSATISFIABLE;
+    if (last >= size) last = size - 1;
+    return RANGE_OK;
+}
+
+struct Connection
+{
+    SOCKET fd = INVALID_SOCKET;
+    char in[MAX_HEADER_BYTES];
+    size_t begin = 0;       // start of the request being parsed
+    size_t end = 0;         // end of received bytes
+    HttpParser parser;
+    string path;            // reused for the file lookup key
+    Output out;
+    int served = 0;
+    bool closing = false;   // close once `out` is flushed
+    bool lingering = false; // response sent and write side shut; dropping input until EOF
+    size_t lingered = 0;
+    unsigned long long bodyLeft = 0;    // request body bytes still to be skipped
+    steady_clock::time_point lastActive;
+    steady_clock::time_point accepted;
+    steady_clock::time_point headStarted;   // first byte of the request being received
+    steady_clock::time_point lastWrite;     // last response queued or bytes sent
+    steady_clock::time_point lingerStart;
+    uint64_t reported = 0;  // out.sentBytes() already added to the stats
+    deque<pair<uint64_t, steady_clock::time_point>> inflight;   // response end offset, request arrival
+
+    // timer wheel links (epoll mode)
+    Connection* wheelPrev = nullptr;
+    Connection* wheelNext = nullptr;
+    int wheelSlot = -1;
+    unsigned wheelRounds = 0;
+
+    // A stalled write, then a half-received head, then plain keep-alive idling.
+    steady_clock::time_point deadline() const
+    {
+        if (lingering) return lingerStart + milliseconds(LINGER_MS);
+        if (!out.empty()) return lastWrite + milliseconds(WRITE_TIMEOUT_MS);
+        if (begin < end) return headStarted + milliseconds(HEADER_TIMEOUT_MS);
+        return lastActive + milliseconds(IDLE_TIMEOUT_MS);
+    }
+
+    // Room for the next recv; moves the unparsed tail to the front when needed.
+    char* space(size_t& room)
+    {
+        if (end == sizeof(in) && begin > 0)
+        {
+            memmove(in, in + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        room = sizeof(in) - end;
+        return in + end;
+    }
+};
+
+// Accounts for bytes that left since the last call and closes the latency
+// samples of every response now fully on the wire.
+void settle(Connection& c)
+{
+    uint64_t sent = c.out.sentBytes();
+    if (sent == c.reported) return;
+    auto now = steady_clock::now();
+    c.lastWrite = now;
+    if (c.reported == 0) stats->firstByte.observe(now - c.accepted);
+    stats->bytesSent.fetch_add(sent - c.reported, memory_order_relaxed);
+    c.reported = sent;
+    while (!c.inflight.empty() && c.inflight.front().first <= sent)
+    {
+        stats->total.observe(now - c.inflight.front().second);
+        c.inflight.pop_front();
+    }
+}
+
+// Handles one complete request head; returns false if the connection must be closed.
+bool handle(const HttpRequest& req, Connection& c, bool keepAlive)
+{
+    // A Content-Length body is skipped before the next head. A chunked or unparsable
+    // one cannot be framed, so that connection closes after the reply.
+    string_view length = req.header("Content-Length");
+    if (!req.header("Transfer-Encoding").empty()) keepAlive = false;
+    else if (!length.empty())
+    {
+        if (length.size() > 19 || length.find_first_not_of("0123456789") != string_view::npos) keepAlive = false;
+        else c.bodyLeft = stoull(string(length));
+    }
+
+    bool head = req.method == "HEAD";
+    if (req.method != "GET" && !head)
+    {
+        reply(c.out, 405, "<h1>405 Method Not Allowed</h1>", false, true);
+        return false;
+    }
+
+    string_view uri = req.target.substr(0, req.target.find('?'));
+    if (uri.empty() || uri[0] != '/' || uri.find("..") != string_view::npos)
+    {
+        reply(c.out, 400, "<h1>400 Bad Request</h1>", false, !head);
+        return false;
+    }
+    if (uri == "/metrics")
+    {
+        replyMetrics(c.out, keepAlive, !head);
+        return keepAlive;
+    }
     if (uri == "/") uri = "/index.html";
 
-    string path = string(ROOT) + uri;
-    string body = readAll(path);
+    c.path.assign(ROOT);
+    c.path.append(uri.data(), uri.size());
+    shared_ptr<const CachedFile> file;
+
+    // prefer a precompressed sibling when the client takes it
+    string_view accept = req.header("Accept-Encoding");
+    size_t baseLen = c.path.size();
+    if (!accept.empty() && acceptsEncoding(accept, "br"))
+    {
+        c.path.append(".br");
+        file = fileCache.get(c.path, BROTLI);
+        c.path.resize(baseLen);
+    }
+    if (!file && !accept.empty() && acceptsEncoding(accept, "gzip"))
+    {
+        c.path.append(".gz");
+        file = fileCache.get(c.path, GZIP);
+        c.path.resize(baseLen);
+    }
+    if (!file) file = fileCache.get(c.path);
 
-    if (body.empty()) {
-        reply(client, 404, "<h1>404 Not Found</h1>");
+    if (!file) {
+        reply(c.out, 404, "<h1>404 Not Found</h1>", keepAlive, !head);
+    }
+    else if (notModified(req, *file)) {
+        replyNotModified(c.out, file, keepAlive);
     }
     else {
-        reply(client, 200, body);
+        unsigned long long first = 0, last = 0;
+        RangeResult range = parseRange(req, *file, first, last);
+        if (range == RANGE_OK) replyRange(c.out, file, first, last, keepAlive, !head);
+        else if (range == RANGE_UNSATISFIABLE) replyUnsatisfiable(c.out, *file, keepAlive);
+        else replyFile(c.out, file, keepAlive, !head);
     }
+    return keepAlive;
+}
 
-    closesocket(client);
+// Answers every complete request head in the buffer; responses are only queued.
+void processInput(Connection& c)
+{
+    auto arrived = steady_clock::now();
+    while (!c.closing && c.begin < c.end)
+    {
+        if (c.bodyLeft > 0)
+        {
+            size_t skip = (size_t)min<unsigned long long>(c.bodyLeft, c.end - c.begin);
+            c.begin += skip;
+            c.bodyLeft -= skip;
+            continue;
+        }
+        HttpParser::Result r = c.parser.parse(c.in + c.begin, c.end - c.begin);
+        if (r == HttpParser::INCOMPLETE) break;
+        if (r == HttpParser::FAILED)
+        {
+            // the method of a request that did not parse is unknown; the connection closes after this
+            reply(c.out, c.parser.error, c.parser.error == 431 ? "<h1>431 Request Header Fields Too Large</h1>" : "<h1>400 Bad Request</h1>", false, true);
+            stats->requests.fetch_add(1, memory_order_relaxed);
+            c.inflight.emplace_back(c.out.queuedBytes(), arrived);
+            c.closing = true;
+            break;
+        }
+        bool keepAlive = c.parser.request.keepAlive() && ++c.served < MAX_REQUESTS_PER_CONN;
+        c.closing = !handle(c.parser.request, c, keepAlive);
+        stats->requests.fetch_add(1, memory_order_relaxed);
+        c.inflight.emplace_back(c.out.queuedBytes(), arrived);
+        c.begin += c.parser.headLength;
+        c.parser.reset();
+        c.lastWrite = arrived;
+        c.headStarted = arrived;
+    }
+    if (c.begin == c.end) c.begin = c.end = 0;
 }
 
-int main() 
+// Closing a socket with unread input makes the kernel answer with RST, which can
+// destroy the response still in flight. Shut the write side and drop what the
+// client keeps sending until it closes, within LINGER_MS and LINGER_BYTES.
+void lingeringClose(SOCKET s)
 {
-    WSADATA wsa;
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-        cerr << "WSAStartup failed\n"; return 1;
+    shutdown(s, SD_SEND);
+    setTimeout(s, SO_RCVTIMEO, LINGER_MS);
+    auto until = steady_clock::now() + milliseconds(LINGER_MS);
+    char buf[4096];
+    size_t drained = 0;
+    while (drained < LINGER_BYTES && steady_clock::now() < until)
+    {
+        int n = recv(s, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        drained += n;
+    }
+}
+
+// Thread-per-connection mode with blocking sockets (Windows, or --blocking).
+void session(SOCKET client)
+{
+    // a client that stops reading makes send time out, which flush reports as 0
+    setTimeout(client, SO_SNDTIMEO, WRITE_TIMEOUT_MS);
+
+    stats = workerStats[0].get();
+    stats->accepted.fetch_add(1, memory_order_relaxed);
+    stats->activeConnections.fetch_add(1, memory_order_relaxed);
+
+    auto conn = make_unique<Connection>();
+    Connection& c = *conn;
+    c.fd = client;
+    c.accepted = steady_clock::now();
+    int recvTimeout = 0;
+    while (!c.closing)
+    {
+        // same deadlines as the epoll timer wheel, enforced with SO_RCVTIMEO
+        auto now = steady_clock::now();
+        if (c.begin == c.end) c.lastActive = now;
+        int left = (int)duration_cast<milliseconds>(c.deadline() - now).count();
+        if (left <= 0) break;
+        if (left != recvTimeout) setTimeout(client, SO_RCVTIMEO, recvTimeout = left);
+
+        size_t room;
+        char* dst = c.space(room);
+        int n = recv(client, dst, (int)room, 0);
+        if (n <= 0) break;
+        if (c.begin == c.end) c.headStarted = steady_clock::now();
+        c.end += n;
+
+        // every complete request in the buffer is answered, responses go out in one send
+        processInput(c);
+        int r = c.out.flush(client);
+        settle(c);
+        if (r <= 0) break;
     }
 
+    if (c.closing && c.out.empty()) lingeringClose(client);
+    closesocket(client);
+    stats->activeConnections.fetch_sub(1, memory_order_relaxed);
+    openConnections.fetch_sub(1, memory_order_relaxed);
+}
+
+SOCKET makeListener(bool shared, int backlog)
+{
     SOCKET srv = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (srv == INVALID_SOCKET) { WSACleanup(); return 1; }
+    if (srv == INVALID_SOCKET) return INVALID_SOCKET;
+
+    int on = 1;
+    setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+#ifdef SO_REUSEPORT
+    if (shared) setsockopt(srv, SOL_SOCKET, SO_REUSEPORT, (const char*)&on, sizeof(on));
+#else
+    (void)shared;
+#endif
 
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(PORT);
 
-    if (bind(srv, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(srv, SOMAXCONN) == SOCKET_ERROR)
+    if (bind(srv, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(srv, backlog) == SOCKET_ERROR)
     {
-        cerr << "bind/listen failed\n";
         closesocket(srv);
-        WSACleanup();
+        return INVALID_SOCKET;
+    }
+    return srv;
+}
+
+#ifdef __linux__
+// Hashed timer wheel with intrusive per-slot lists: re-arming a connection after
+// every event is O(1), and a tick only walks the connections filed in its slot
+// instead of sweeping all of them. Deadlines past one turn wait extra rounds.
+class TimerWheel
+{
+public:
+    explicit TimerWheel(steady_clock::time_point now) : slots(WHEEL_SLOTS, nullptr), tickTime(now) {}
+
+    void schedule(Connection* c, steady_clock::time_point deadline)
+    {
+        cancel(c);
+        auto ahead = deadline - tickTime;
+        long long ticks = ahead <= steady_clock::duration::zero() ? 0 : (duration_cast<milliseconds>(ahead).count() + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+        c->wheelSlot = (int)((cursor + ticks) % WHEEL_SLOTS);
+        c->wheelRounds = (unsigned)(ticks / WHEEL_SLOTS);
+        c->wheelPrev = nullptr;
+        c->wheelNext = slots[c->wheelSlot];
+        if (c->wheelNext) c->wheelNext->wheelPrev = c;
+        slots[c->wheelSlot] = c;
+    }
+
+    void cancel(Connection* c)
+    {
+        if (c->wheelSlot < 0) return;
+        if (c->wheelPrev) c->wheelPrev->wheelNext = c->wheelNext;
+        else slots[c->wheelSlot] = c->wheelNext;
+        if (c->wheelNext) c->wheelNext->wheelPrev = c->wheelPrev;
+        c->wheelPrev = c->wheelNext = nullptr;
+        c->wheelSlot = -1;
+    }
+
+    // Moves the wheel up to `now`, unlinking every connection whose slot came due.
+    void advance(steady_clock::time_point now, vector<Connection*>& expired)
+    {
+        while (tickTime <= now)
+        {
+            for (Connection* c = slots[cursor]; c; )
+            {
+                Connection* next = c->wheelNext;
+                if (c->wheelRounds > 0) --c->wheelRounds;
+                else
+                {
+                    cancel(c);
+                    expired.push_back(c);
+                }
+                c = next;
+            }
+            cursor = (cursor + 1) % WHEEL_SLOTS;
+            tickTime += milliseconds(WHEEL_TICK_MS);
+        }
+    }
+
+private:
+    vector<Connection*> slots;
+    size_t cursor = 0;
+    steady_clock::time_point tickTime;  // when the slot at `cursor` comes due
+};
+
+// One shard: its own SO_REUSEPORT listener (the kernel spreads new connections
+// across shards) and an edge-triggered epoll loop over non-blocking sockets.
+// New connections are taken at most ACCEPT_BATCH per round and only after the
+// ready connections were served; the rest wait in the kernel accept queue.
+void epollWorker(SOCKET srv, WorkerStats* ws)
+{
+    stats = ws;
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = srv;
+    epoll_ctl(ep, EPOLL_CTL_ADD, srv, &ev);
+
+    unordered_map<int, unique_ptr<Connection>> conns;
+    epoll_event events[256];
+    TimerWheel wheel(steady_clock::now());
+    vector<Connection*> expired;
+    bool acceptReady = false;
+
+    auto closeConn = [&](int fd)
+    {
+        auto it = conns.find(fd);
+        wheel.cancel(it->second.get());
+        epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        conns.erase(it);
+        stats->activeConnections.fetch_sub(1, memory_order_relaxed);
+        openConnections.fetch_sub(1, memory_order_relaxed);
+    };
+
+    while (true)
+    {
+        int n = epoll_wait(ep, events, 256, acceptReady ? 0 : WHEEL_TICK_MS);
+        auto now = steady_clock::now();
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == srv)
+            {
+                acceptReady = true;
+                continue;
+            }
+
+            auto it = conns.find(fd);
+            if (it == conns.end()) continue;
+            Connection& c = *it->second;
+            c.lastActive = now;
+
+            // Edge-triggered: drain the socket, but stop reading while responses are
+            // still queued; the EPOLLOUT edge brings us back here to continue.
+            bool dead = (events[i].events & EPOLLERR) != 0;
+            while (!dead)
+            {
+                int r = c.out.flush(fd);
+                settle(c);
+                if (r < 0) { dead = true; break; }
+                if (r == 0) break;
+                if (c.closing && !c.lingering)
+                {
+                    // same as lingeringClose, driven by epoll and the timer wheel
+                    shutdown(fd, SHUT_WR);
+                    c.lingering = true;
+                    c.lingerStart = now;
+                    c.begin = c.end = 0;
+                }
+
+                size_t room;
+                char* dst = c.space(room);
+                ssize_t got = recv(fd, dst, room, 0);
+                if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) { dead = true; break; }
+                if (got < 0) break;
+                if (c.lingering)
+                {
+                    c.lingered += (size_t)got;
+                    if (c.lingered >= LINGER_BYTES) { dead = true; break; }
+                    continue;
+                }
+                if (c.begin == c.end) c.headStarted = now;
+                c.end += (size_t)got;
+                processInput(c);
+            }
+            if (dead) closeConn(fd);
+            else wheel.schedule(&c, c.deadline());
+        }
+
+        for (int budget = ACCEPT_BATCH; acceptReady && budget > 0; --budget)
+        {
+            int cli = accept4(srv, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (cli < 0)
+            {
+                if (errno != EINTR && errno != ECONNABORTED) acceptReady = false;
+                continue;
+            }
+            if (!admitConnection())
+            {
+                rejectOverloaded(cli);
+                continue;
+            }
+            auto c = make_unique<Connection>();
+            c->fd = cli;
+            c->lastActive = c->accepted = now;
+            stats->accepted.fetch_add(1, memory_order_relaxed);
+            stats->activeConnections.fetch_add(1, memory_order_relaxed);
+            wheel.schedule(c.get(), c->deadline());
+            epoll_event cev{};
+            cev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            cev.data.fd = cli;
+            epoll_ctl(ep, EPOLL_CTL_ADD, cli, &cev);
+            conns[cli] = move(c);
+        }
+
+        expired.clear();
+        wheel.advance(steady_clock::now(), expired);
+        for (Connection* c : expired) closeConn(c->fd);
+    }
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    bool blocking = false;
+    unsigned workers = max(1u, thread::hardware_concurrency());
+    int backlog = SOMAXCONN;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--blocking") blocking = true;
+        else if (arg == "--workers" && i + 1 < argc) workers = max(1, atoi(argv[++i]));
+        else if (arg == "--max-connections" && i + 1 < argc) maxConnections = max(1, atoi(argv[++i]));
+        else if (arg == "--backlog" && i + 1 < argc) backlog = max(1, atoi(argv[++i]));
+        else { cerr << "usage: POlab5 [--blocking] [--workers N] [--max-connections N] [--backlog N]\n"; return 1; }
+    }
+
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        cerr << "WSAStartup failed\n"; return 1;
+    }
+    blocking = true;
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+#ifndef __linux__
+    blocking = true;
+#endif
+
+#ifdef __linux__
+    if (!blocking)
+    {
+        vector<thread> shards;
+        for (unsigned i = 0; i < workers; ++i) workerStats.push_back(make_unique<WorkerStats>());
+        for (unsigned i = 0; i < workers; ++i)
+        {
+            SOCKET srv = makeListener(true, backlog);
+            if (srv == INVALID_SOCKET) { cerr << "bind/listen failed\n"; return 1; }
+            fcntl(srv, F_SETFL, fcntl(srv, F_GETFL) | O_NONBLOCK);
+            shards.emplace_back(epollWorker, srv, workerStats[i].get());
+        }
+        cout << "Listening on http://localhost:" << PORT << " (" << workers << " epoll workers)\n";
+        for (auto& t : shards) t.join();
+        return 0;
+    }
+#endif
+
+    workerStats.push_back(make_unique<WorkerStats>());
+    stats = workerStats[0].get();
+    SOCKET srv = makeListener(false, backlog);
+    if (srv == INVALID_SOCKET)
+    {
+        cerr << "bind/listen failed\n";
         return 1;
     }
 
@@ -99,10 +1516,14 @@ int main()
     while (true) {
         SOCKET cli = accept(srv, nullptr, nullptr);
         if (cli == INVALID_SOCKET) continue;
-        thread(session, cli).detach();
+        // the cap bounds the number of session threads
+        if (!admitConnection()) rejectOverloaded(cli);
+        else thread(session, cli).detach();
     }
 
     closesocket(srv);
+#ifdef _WIN32
     WSACleanup();
+#endif
     return 0;
 }
@@ -0,0 +1,551 @@
+﻿// HTTP load generator for the lab5 server (Linux, epoll).
+//
+// Closed loop (default): every connection sends its next request as soon as the
+// previous response is in. Open loop (--rate R): requests are scheduled at R/s
+// no matter how fast the server answers, and latency is measured from the
+// scheduled time, so a stalled server shows up in the percentiles instead of
+// quietly slowing the generator down (coordinated omission).
+//
+// Build: g++ -std=c++17 -O2 -pthread loadgen.cpp -o loadgen
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+struct Options
+{
+    string host = "127.0.0.1";
+    int port = 8080;
+    int connections = 50;
+    int threads = (int)min(4u, max(1u, thread::hardware_concurrency()));
+    double duration = 10;   // seconds
+    double rate = 0;        // requests/s over all threads, 0 = closed loop
+    double calibrate = 1;   // closed loop: seconds run first to measure the expected interval
+};
+
+// Same mix as lab5.py: @task(2) for "/" and @task(1) for "/page2.html".
+struct Target
+{
+    const char* path;
+    int weight;
+};
+
+const Target TARGETS[] = { { "/", 2 }, { "/page2.html", 1 } };
+const int TARGET_COUNT = sizeof(TARGETS) / sizeof(TARGETS[0]);
+
+struct Result
+{
+    vector<uint32_t> latencyUs;     // from the scheduled send time
+    vector<uint32_t> serviceUs;     // from the moment the request was written
+    uint64_t completed = 0;
+    uint64_t errors = 0;            // failed connections, lost requests, 4xx/5xx
+    uint64_t bytes = 0;
+    uint64_t backlog = 0;           // open loop: scheduled but never sent
+    uint64_t perTarget[TARGET_COUNT] = {};
+};
+
+struct Conn
+{
+    int fd = -1;
+    bool connected = false;
+    bool busy = false;
+    string out;
+    size_t outPos = 0;
+    string head;                // response head collected until the blank line
+    long long bodyLeft = -1;    // -1 while the head is incomplete
+    int status = 0;
+    bool closeAfter = false;
+    int target = 0;
+    steady_clock::time_point scheduled;
+    steady_clock::time_point sent;
+    steady_clock::time_point retryAt;
+};
+
+bool equalsNoCase(string_view a, string_view b)
+{
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+    }
+    return true;
+}
+
+// Status, Content-Length and Connection from a response head (without the blank line).
+bool parseHead(string_view head, Conn& c)
+{
+    if (head.size() < 12 || head.substr(0, 5) != "HTTP/") return false;
+    c.status = atoi(string(head.substr(9, 3)).c_str());
+    c.bodyLeft = 0;
+    c.closeAfter = head.substr(0, 8) == "HTTP/1.0";
+    size_t pos = head.find("\r\n");
+    while (pos != string_view::npos && pos + 2 < head.size())
+    {
+        size_t lineEnd = head.find("\r\n", pos + 2);
+        if (lineEnd == string_view::npos) lineEnd = head.size();
+        string_view line = head.substr(pos + 2, lineEnd - pos - 2);
+        size_t colon = line.find(':');
+        if (colon != string_view::npos)
+        {
+            string_view name = line.substr(0, colon);
+            string_view value = line.substr(colon + 1);
+            while (!value.empty() && value.front() == ' ') value.remove_prefix(1);
+            if (equalsNoCase(name, "Content-Length")) c.bodyLeft = atoll(string(value).c_str());
+            else if (equalsNoCase(name, "Connection")) c.closeAfter = equalsNoCase(value, "close");
+        }
+        pos = lineEnd;
+    }
+    return c.status > 0;
+}
+
+// One epoll loop over its share of the connections; one request in flight per
+// connection, the next one reuses it (keep-alive).
+class Worker
+{
+public:
+    Worker(const Options& opt, int connections, double rate, Result& res)
+        : opt(opt), rate(rate), res(res), conns(connections), rng(random_device{}())
+    {
+        for (int i = 0; i < TARGET_COUNT; ++i)
+        {
+            requests.push_back(string("GET ") + TARGETS[i].path + " HTTP/1.1\r\nHost: " + opt.host + "\r\nConnection: keep-alive\r\n\r\n");
+            totalWeight += TARGETS[i].weight;
+        }
+    }
+
+    void run(steady_clock::time_point begin, steady_clock::time_point stop);
+
+private:
+    const Options& opt;
+    double rate;
+    Result& res;
+    vector<Conn> conns;
+    vector<int> idle;                           // open loop: connected, nothing to send
+    deque<steady_clock::time_point> pending;    // open loop: due but no free connection
+    vector<string> requests;
+    int totalWeight = 0;
+    mt19937 rng;
+    int ep = -1;
+    int timer = -1;                             // open loop: fires at the next due time
+    sockaddr_in addr{};
+    steady_clock::time_point stopAt;
+    char buf[64 * 1024];
+
+    int pickTarget()
+    {
+        int r = uniform_int_distribution<int>(0, totalWeight - 1)(rng);
+        int t = 0;
+        while (r >= TARGETS[t].weight) r -= TARGETS[t++].weight;
+        return t;
+    }
+
+    void open(int i, steady_clock::time_point now);
+    void fail(int i, steady_clock::time_point now);
+    void send(int i, steady_clock::time_point scheduled);
+    void writeOut(int i);
+    void readIn(int i);
+    void ready(int i, steady_clock::time_point now);
+};
+
+void Worker::open(int i, steady_clock::time_point now)
+{
+    Conn& c = conns[i];
+    c = Conn();
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (c.fd < 0)
+    {
+        c.retryAt = now + milliseconds(100);
+        return;
+    }
+    int on = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(c.fd, (sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+    {
+        fail(i, now);
+        return;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u32 = (uint32_t)i;
+    epoll_ctl(ep, EPOLL_CTL_ADD, c.fd, &ev);
+}
+
+// The request in flight (if any) is lost; the slot reconnects after a pause so a
+// refused port does not turn into a busy loop.
+void Worker::fail(int i, steady_clock::time_point now)
+{
+    Conn& c = conns[i];
+    if (c.busy || !c.connected) ++res.errors;
+    if (c.fd >= 0) close(c.fd);
+    c.fd = -1;
+    c.connected = false;
+    c.busy = false;
+    c.retryAt = now + milliseconds(100);
+    idle.erase(remove(idle.begin(), idle.end(), i), idle.end());
+}
+
+void Worker::send(int i, steady_clock::time_point scheduled)
+{
+    Conn& c = conns[i];
+    c.busy = true;
+    c.scheduled = scheduled;
+    c.sent = steady_clock::now();
+    c.target = pickTarget();
+    c.out = requests[c.target];
+    c.outPos = 0;
+    c.head.clear();
+    c.bodyLeft = -1;
+    writeOut(i);
+}
+
+void Worker::writeOut(int i)
+{
+    Conn& c = conns[i];
+    while (c.outPos < c.out.size())
+    {
+        ssize_t n = ::send(c.fd, c.out.data() + c.outPos, c.out.size() - c.outPos, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) fail(i, steady_clock::now());
+            return;
+        }
+        c.outPos += (size_t)n;
+    }
+}
+
+// The connection is free: closed loop sends right away, open loop takes the
+// oldest due request or waits in `idle` for the next one.
+void Worker::ready(int i, steady_clock::time_point now)
+{
+    if (now >= stopAt) return;
+    if (rate <= 0)
+    {
+        send(i, now);
+    }
+    else if (!pending.empty())
+    {
+        auto due = pending.front();
+        pending.pop_front();
+        send(i, due);
+    }
+    else idle.push_back(i);
+}
+
+void Worker::readIn(int i)
+{
+    Conn& c = conns[i];
+    while (c.fd >= 0)
+    {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            fail(i, steady_clock::now());
+            return;
+        }
+        if (n < 0) return;
+        res.bytes += (uint64_t)n;
+        if (!c.busy) continue;
+
+        size_t used = 0;
+        if (c.bodyLeft < 0)
+        {
+            size_t old = c.head.size();
+            c.head.append(buf, (size_t)n);
+            size_t end = c.head.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+            if (end == string::npos) continue;
+            if (!parseHead(string_view(c.head.data(), end + 2), c))
+            {
+                fail(i, steady_clock::now());
+                return;
+            }
+            used = end + 4 - old;
+        }
+        c.bodyLeft -= min<long long>(c.bodyLeft, (long long)((size_t)n - used));
+        if (c.bodyLeft > 0) continue;
+
+        auto done = steady_clock::now();
+        auto us = [](steady_clock::duration d) { return (uint32_t)min<long long>(duration_cast<microseconds>(d).count(), UINT32_MAX); };
+        res.latencyUs.push_back(us(done - c.scheduled));
+        res.serviceUs.push_back(us(done - c.sent));
+        ++res.completed;
+        ++res.perTarget[c.target];
+        if (c.status >= 400) ++res.errors;
+        c.busy = false;
+        if (c.closeAfter)
+        {
+            close(c.fd);
+            c.fd = -1;
+            c.connected = false;
+            c.retryAt = done;
+            return;
+        }
+        ready(i, done);
+    }
+}
+
+void Worker::run(steady_clock::time_point begin, steady_clock::time_point stop)
+{
+    stopAt = stop;
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)opt.port);
+    inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr);
+
+    // steady_clock is CLOCK_MONOTONIC, so due times map straight onto the timerfd
+    const uint32_t TIMER_EVENT = UINT32_MAX;
+    if (rate > 0)
+    {
+        timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u32 = TIMER_EVENT;
+        epoll_ctl(ep, EPOLL_CTL_ADD, timer, &ev);
+    }
+
+    this_thread::sleep_until(begin);
+    for (size_t i = 0; i < conns.size(); ++i) open((int)i, begin);
+
+    double intervalNs = rate > 0 ? 1e9 / rate : 0;
+    uint64_t scheduled = 0;
+    auto drainUntil = stop + seconds(2);
+    epoll_event events[256];
+    while (true)
+    {
+        auto now = steady_clock::now();
+        if (now >= stop)
+        {
+            bool inFlight = any_of(conns.begin(), conns.end(), [](const Conn& c) { return c.busy; });
+            if (!inFlight || now >= drainUntil) break;
+        }
+
+        // open loop: everything that fell due goes out now, whatever is still
+        // waiting for a connection keeps its original due time
+        steady_clock::time_point nextDue = stop;
+        while (rate > 0)
+        {
+            auto due = begin + nanoseconds((long long)(scheduled * intervalNs));
+            if (due >= stop) break;
+            if (due > now)
+            {
+                nextDue = due;
+                break;
+            }
+            ++scheduled;
+            if (idle.empty()) pending.push_back(due);
+            else
+            {
+                int i = idle.back();
+                idle.pop_back();
+                send(i, due);
+            }
+        }
+
+        for (size_t i = 0; i < conns.size(); ++i)
+        {
+            if (conns[i].fd < 0 && now < stop && now >= conns[i].retryAt) open((int)i, now);
+        }
+
+        if (rate > 0 && nextDue < stop)
+        {
+            itimerspec when{};
+            auto ns = duration_cast<nanoseconds>(nextDue.time_since_epoch()).count();
+            when.it_value.tv_sec = ns / 1000000000;
+            when.it_value.tv_nsec = ns % 1000000000;
+            timerfd_settime(timer, TFD_TIMER_ABSTIME, &when, nullptr);
+        }
+        int n = epoll_wait(ep, events, 256, 10);
+        for (int k = 0; k < n; ++k)
+        {
+            if (events[k].data.u32 == TIMER_EVENT)
+            {
+                uint64_t expirations;
+                while (read(timer, &expirations, sizeof(expirations)) > 0) {}
+                continue;
+            }
+            int i = (int)events[k].data.u32;
+            Conn& c = conns[i];
+            if (c.fd < 0) continue;
+            if (!c.connected && (events[k].events & (EPOLLOUT | EPOLLERR)))
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0)
+                {
+                    fail(i, steady_clock::now());
+                    continue;
+                }
+                c.connected = true;
+                ready(i, steady_clock::now());
+            }
+            if (c.fd >= 0 && c.busy && (events[k].events & EPOLLOUT)) writeOut(i);
+            if (c.fd >= 0 && (events[k].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) readIn(i);
+        }
+    }
+
+    res.backlog = pending.size();
+    for (auto& c : conns)
+    {
+        if (c.fd >= 0) close(c.fd);
+    }
+    if (timer >= 0) close(timer);
+    close(ep);
+}
+
+double percentileMs(const vector<uint32_t>& sorted, double p)
+{
+    if (sorted.empty()) return 0;
+    size_t idx = (size_t)ceil(p / 100.0 * sorted.size());
+    return sorted[idx == 0 ? 0 : idx - 1] / 1000.0;
+}
+
+void printLatency(const char* label, vector<uint32_t>& samples)
+{
+    sort(samples.begin(), samples.end());
+    cout << "  " << left << setw(22) << label << right << fixed << setprecision(3);
+    for (double p : { 50.0, 90.0, 99.0, 99.9, 99.99 }) cout << setw(10) << percentileMs(samples, p);
+    cout << setw(10) << (samples.empty() ? 0 : samples.back() / 1000.0) << "\n";
+}
+
+// Closed loop only measures requests the server let us send. Every sample longer
+// than the interval a connection meant to keep between requests adds the samples
+// a steady sender would have seen while it was stuck: v - interval, v - 2*interval, ...
+// The interval has to come from outside the run being corrected; derived from
+// its own samples, a stall would inflate it and hide itself.
+vector<uint32_t> correctForOmission(const vector<uint32_t>& samples, uint32_t intervalUs)
+{
+    vector<uint32_t> out = samples;
+    uint32_t interval = max(1u, intervalUs);
+    for (uint32_t v : samples)
+    {
+        for (uint32_t missed = v > interval ? v - interval : 0; missed >= interval; missed -= interval)
+        {
+            out.push_back(missed);
+        }
+    }
+    return out;
+}
+
+int main(int argc, char* argv[])
+{
+    Options opt;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--host" && hasValue) opt.host = argv[++i];
+        else if (arg == "--port" && hasValue) opt.port = atoi(argv[++i]);
+        else if (arg == "--connections" && hasValue) opt.connections = max(1, atoi(argv[++i]));
+        else if (arg == "--threads" && hasValue) opt.threads = max(1, atoi(argv[++i]));
+        else if (arg == "--duration" && hasValue) opt.duration = max(0.1, atof(argv[++i]));
+        else if (arg == "--rate" && hasValue) opt.rate = max(0.0, atof(argv[++i]));
+        else if (arg == "--calibrate" && hasValue) opt.calibrate = max(0.0, atof(argv[++i]));
+        else
+        {
+            cerr << "usage: loadgen [--host 127.0.0.1] [--port 8080] [--connections 50] [--threads N]\n"
+                 << "               [--duration SECONDS] [--rate REQUESTS_PER_SECOND (0 = closed loop)]\n"
+                 << "               [--calibrate SECONDS (closed loop warm-up whose mean service time is\n"
+                 << "                the expected interval for the CO correction; 0 = no correction)]\n";
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    opt.threads = min(opt.threads, opt.connections);
+
+    auto runFor = [&opt](double seconds)
+    {
+        vector<Result> results(opt.threads);
+        vector<unique_ptr<Worker>> workers;
+        for (int t = 0; t < opt.threads; ++t)
+        {
+            int share = opt.connections / opt.threads + (t < opt.connections % opt.threads ? 1 : 0);
+            workers.push_back(make_unique<Worker>(opt, share, opt.rate / opt.threads, results[t]));
+        }
+
+        auto begin = steady_clock::now() + milliseconds(50);
+        auto stop = begin + duration_cast<steady_clock::duration>(duration<double>(seconds));
+        vector<thread> threads;
+        for (auto& w : workers) threads.emplace_back([&w, begin, stop] { w->run(begin, stop); });
+        for (auto& t : threads) t.join();
+        return results;
+    };
+
+    // closed loop has no think time, so the interval a connection intends between
+    // requests is the service time of a server that is not stalling
+    uint32_t expectedUs = 0;
+    if (opt.rate <= 0 && opt.calibrate > 0)
+    {
+        double sum = 0;
+        size_t count = 0;
+        for (auto& r : runFor(opt.calibrate))
+        {
+            for (uint32_t v : r.serviceUs) sum += v;
+            count += r.serviceUs.size();
+        }
+        if (count > 0) expectedUs = (uint32_t)max(1.0, sum / count);
+    }
+
+    vector<Result> results = runFor(opt.duration);
+
+    Result total;
+    for (auto& r : results)
+    {
+        total.latencyUs.insert(total.latencyUs.end(), r.latencyUs.begin(), r.latencyUs.end());
+        total.serviceUs.insert(total.serviceUs.end(), r.serviceUs.begin(), r.serviceUs.end());
+        total.completed += r.completed;
+        total.errors += r.errors;
+        total.bytes += r.bytes;
+        total.backlog += r.backlog;
+        for (int i = 0; i < TARGET_COUNT; ++i) total.perTarget[i] += r.perTarget[i];
+    }
+
+    cout << (opt.rate > 0 ? "Open loop at " + to_string((long long)opt.rate) + " req/s" : string("Closed loop"))
+         << ", " << opt.connections << " connections, " << opt.threads << " threads, " << opt.duration << " s\n";
+    cout << "Requests: " << total.completed << " completed (";
+    for (int i = 0; i < TARGET_COUNT; ++i) cout << (i ? ", " : "") << TARGETS[i].path << " " << total.perTarget[i];
+    cout << "), " << total.errors << " errors";
+    if (opt.rate > 0) cout << ", " << total.backlog << " never sent";
+    cout << "\n";
+    cout << fixed << setprecision(1)
+         << "Throughput: " << total.completed / opt.duration << " req/s, "
+         << total.bytes / opt.duration / (1024 * 1024) << " MB/s\n";
+
+    cout << "Latency (ms)            " << right;
+    for (const char* p : { "p50", "p90", "p99", "p99.9", "p99.99", "max" }) cout << setw(10) << p;
+    cout << "\n";
+    printLatency("service", total.serviceUs);
+    if (opt.rate > 0)
+    {
+        printLatency("from schedule", total.latencyUs);
+    }
+    else if (expectedUs > 0)
+    {
+        vector<uint32_t> corrected = correctForOmission(total.latencyUs, expectedUs);
+        printLatency("CO-corrected", corrected);
+        cout << "  (expected interval " << setprecision(3) << expectedUs / 1000.0 << " ms from a " << setprecision(1) << opt.calibrate << " s calibration run)\n";
+    }
+    return 0;
+}
@@ -1,47 +1,348 @@
-﻿#define _WINSOCK_DEPRECATED_NO_WARNINGS
+﻿#ifdef _WIN32
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#define NOMINMAX
 #include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define SD_BOTH SHUT_RDWR
+#endif
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <cerrno>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
 #include <unordered_map>
 #include <thread>
 #include <vector>
 #include <string>
 #include <atomic>
 #include <limits>
+#include <list>
 #include <sstream>
-
-#pragma comment(lib, "ws2_32.lib")
+#include <type_traits>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 using namespace std;
 using namespace chrono;
 
-struct CommandPacket 
+enum MessageType : uint8_t
+{
+    MSG_HELLO = 1,
+    MSG_WELCOME,
+    MSG_UPLOAD_MATRIX,
+    MSG_MATRIX_RECEIVED,
+    MSG_START_PROCESSING,
+    MSG_PROCESSING_STARTED,
+    MSG_INFO,
+    MSG_PROCESSING_COMPLETED,
+    MSG_REQUEST_STATUS,
+    MSG_STATUS,
+    MSG_REQUEST_RESULTS,
+    MSG_RESULTS,
+    MSG_ERROR,
+    MSG_BUSY,
+    MSG_SUBSCRIBE_PROGRESS,
+    MSG_PROGRESS,
+    MSG_REQUEST_DIAGONAL,
+    MSG_DIAGONAL,
+    MSG_DISCARD_TASK,
+    MSG_COMPUTE_BLOCK,      // coordinator -> peer: rows of a matrix to run on the peer's pool
+    MSG_BLOCK_RESULT,
+    MSG_ATTACH_JOB,         // binds a stored job to a task id of this connection
+    MSG_OPERATE,            // [op][threads][operand count][operand task ids], result goes to the frame's id
+    MSG_OPERATION_DONE,
+    MSG_REQUEST_MATRIX,
+    MSG_MATRIX              // [n][element type][bytes u64], the cells follow the frame like an upload's
+};
+
+// frame = [uint32 payload length][uint8 type][uint32 task id][payload]
+// The id names the task a request is about and comes back on every reply and
+// pushed event, so one connection can have many uploads and runs in flight.
+// Connection-level frames (HELLO/WELCOME) use whatever id the client sent.
+const size_t FRAME_HEADER_SIZE = 9;
+const uint32_t MAX_CONTROL_PAYLOAD = 64 * 1024;    // frames without matrix cells
+const uint32_t MAX_BLOCK_PAYLOAD = 1u << 30;        // one COMPUTE_BLOCK or BLOCK_RESULT
+const size_t MAX_TASKS_PER_SESSION = 64;
+const int MAX_MATRIX_SIZE = 1 << 20;    // keeps n*n*cell size far from overflowing 64 bits
+const char DEFAULT_UNIX_PATH[] = "/tmp/matrix-server.sock";
+const uint16_t DEFAULT_PORT = 12345;
+const size_t BLOCKS_PER_PEER = 4;       // more blocks than peers so a slow or lost peer costs less
+const int PEER_TIMEOUT_MS = 60000;
+const size_t STORE_BLOCK_BYTES = 8u << 20;     // readahead/drop granularity for stored matrices
+
+// Cells are 16, 32 or 64-bit integers or floats; the client names the type in the
+// upload header and every kernel is instantiated once per type.
+enum ElementType : uint32_t
 {
-    uint32_t length;
-    char command[256];
+    ELEM_INT16 = 1,
+    ELEM_INT32,
+    ELEM_INT64,
+    ELEM_FLOAT
 };
 
-struct MatrixUploadInfo 
+// 0 for types this build does not know, which is how a client learns to fall back
+size_t elementSize(uint32_t type)
+{
+    switch (type)
+    {
+    case ELEM_INT16: return 2;
+    case ELEM_INT32: return 4;
+    case ELEM_INT64: return 8;
+    case ELEM_FLOAT: return 4;
+    default: return 0;
+    }
+}
+
+struct MatrixUploadInfo
 {
     uint32_t matrix_size;
     uint32_t num_threads;
-    uint32_t matrix_bytes;
+    uint64_t matrix_bytes;
+    uint32_t element_type;
+    uint32_t flags;
+};
+
+const uint32_t UPLOAD_SHARED = 1;   // flags: the cells are in a memfd sent with the frame
+
+// Matrix cells mapped from the memfd a local client passed over the Unix socket,
+// or from the job's file in the --store-dir (then `path` is set and removed with it).
+struct MappedMatrix
+{
+    void* base = nullptr;
+    size_t bytes = 0;
+    string path;
+
+    ~MappedMatrix()
+    {
+#ifndef _WIN32
+        if (base)
+        {
+            munmap(base, bytes);
+        }
+        if (!path.empty())
+        {
+            unlink(path.c_str());
+        }
+#endif
+    }
+};
+
+struct ClientTask;
+
+// One client connection. `tasks` is only touched by the connection's own thread;
+// the scheduler keeps its own references to tasks that are queued or running.
+struct Session
+{
+    SOCKET sock = INVALID_SOCKET;
+    atomic<bool> connected{ true };     // cleared under sendMtx with the close; finishRun reads it without
+    mutex sendMtx;
+    unordered_map<uint32_t, shared_ptr<ClientTask>> tasks;
+
+    // frames from compute workers, sent in order by the session's writer thread
+    mutex outMtx;       // guards outbox and closing
+    condition_variable outCv;
+    string outbox;
+    bool closing = false;
 };
 
+// One uploaded matrix of a session and its runs.
 struct ClientTask
 {
-    vector<vector<int>> matrix;
+    // where events go; a stored job can be attached from a later connection,
+    // so once the task is shared these two are only touched under ownerMtx
+    shared_ptr<Session> session;
+    uint32_t id = 0;
+    mutex ownerMtx;
+    uint32_t jobId = 0;     // non-zero when the matrix is in the store and the job outlives its connection
+    int64_t unusedSinceNs = 0;  // stored jobs: when the sweeper first saw it unused, 0 = in use
+    int n = 0;
+    uint32_t type = ELEM_INT32;
+    vector<uint64_t> matrix;    // row-major n*n cells of `type`, read-only once uploaded; words only for alignment
+    unique_ptr<MappedMatrix> mapped;    // used instead of `matrix` for memfd uploads and stored jobs
+    vector<uint64_t> sums;      // per row, the Accumulator bits written by the current run
+    uint64_t hash = 0;          // content hash of the uploaded matrix, key into resultCache
     vector<int> cfg;
-    vector<double> time_res;
-    size_t idx = 0;
-    bool isProcessing = 0;
+    vector<double> time_res;    // per cfg entry, negative while not done
+    vector<uint64_t> resultDiagonal;
+    vector<size_t> runOrder;    // cfg indices that were not in the cache
+    size_t runPos = 0;
+    atomic<size_t> idx{ 0 };
+    atomic<bool> isProcessing{ false };
+    atomic<bool> discarded{ false };    // the client dropped the id: stop after the running config
+    atomic<int> operationReads{ 0 };    // operations reading this matrix; START waits for them
+    bool isRunning = false;     // a config of this client is on the pool right now
+    atomic<uint32_t> progressIntervalMs{ 0 };   // 0 = not subscribed
+    atomic<int> rowsDone{ 0 };
+    atomic<int64_t> runStartNs{ 0 };
+    atomic<int64_t> nextProgressNs{ 0 };
+    mutex resMtx;
+
+    void* cells() { return mapped ? mapped->base : matrix.data(); }
+    size_t bytes() const { return static_cast<size_t>(n) * n * elementSize(type); }
+
+    void allocate()
+    {
+        matrix.assign((bytes() + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+    }
+
+    shared_ptr<Session> owner(uint32_t& ownerId)
+    {
+        lock_guard<mutex> lock(ownerMtx);
+        ownerId = id;
+        return session;
+    }
+};
+
+class ComputePool
+{
+public:
+    explicit ComputePool(unsigned threads);
+    ~ComputePool();
+
+    void addTask(function<void()> task);
+    unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+private:
+    queue<function<void()>> tasks;
+    mutex mtx;
+    condition_variable cv;
+    bool stop = false;
+    vector<thread> workers;
+
+    void workerFunction();
+};
+
+// Admits START_PROCESSING jobs and feeds their configs to the pool one at a time,
+// round-robin across clients (one queue per session), as long as the reserved
+// cores fit in the budget.
+class JobScheduler
+{
+public:
+    JobScheduler(unsigned cpuBudget, size_t maxJobs);
+
+    bool admit(uint32_t& retryAfterMs);
+    bool idle();
+    void enqueue(const shared_ptr<ClientTask>& ct);
+    void submit(const Session* client, const shared_ptr<ClientTask>& ct, int threads, function<void(function<void()>)> run);
+    void cancel(const shared_ptr<ClientTask>& ct);
+    size_t queuePosition(const ClientTask& ct);
+
+private:
+    // the next config of a task's run, or a one-off job (an operation) when run is set
+    struct Job
+    {
+        shared_ptr<ClientTask> ct;
+        int threads = 0;
+        function<void(function<void()>)> run;
+    };
+
+    mutex mtx;
+    unsigned budget;
+    unsigned inUse = 0;
+    size_t maxJobs;
+    size_t activeJobs = 0;
+    // a client's work waits in its own queue; `turns` lists each client with work
+    // once, and the front one goes next, so a client with many configs waiting
+    // gets no more turns than one with a single config
+    unordered_map<const Session*, deque<Job>> queues;
+    deque<const Session*> turns;
+    size_t queued = 0;
+    double avgRunMs = 0;
+
+    unsigned coresFor(int threads) const { return static_cast<unsigned>(max(1, min<int>(threads, budget))); }
+    void push(const Session* client, Job job);
+    void dispatch();
+    void finishRun(const shared_ptr<ClientTask>& ct, unsigned cores, double seconds);
+    void finishJob(unsigned cores, double seconds);
+};
+
+struct CachedResult
+{
+    int n = 0;
+    vector<uint64_t> diagonal;
+    unordered_map<int, double> seconds;   // thread count -> measured time
+};
+
+// Results of finished runs keyed by matrix content hash, LRU-evicted by size.
+// Lives for the whole process so a reconnecting client still hits it.
+class ResultCache
+{
+public:
+    explicit ResultCache(size_t maxBytes) : maxBytes(maxBytes) {}
+
+    bool lookup(uint64_t hash, int n, CachedResult& out);
+    void store(uint64_t hash, int n, int threads, double seconds, const vector<uint64_t>& diagonal);
+
+private:
+    struct Entry
+    {
+        uint64_t hash;
+        CachedResult result;
+        size_t bytes;
+    };
+
+    mutex mtx;
+    size_t maxBytes;
+    size_t usedBytes = 0;
+    list<Entry> lru;    // front = most recently used
+    unordered_map<uint64_t, list<Entry>::iterator> index;
+};
+
+mutex clients_mtx;
+unordered_map<SOCKET, shared_ptr<Session>> clients_list;
+unique_ptr<ComputePool> computePool;
+unique_ptr<JobScheduler> scheduler;
+unique_ptr<ResultCache> resultCache;
+int rowDelayMs = 0;
+
+struct Peer
+{
+    string host;
+    string port;
 };
+vector<Peer> peers;     // coordinator mode when not empty
 
-unordered_map<SOCKET, ClientTask> clients_list;
+string storeDir;        // out-of-core store when not empty
+mutex storeMtx;
+unordered_map<uint32_t, shared_ptr<ClientTask>> storedJobs;
+uint32_t nextJobId = 1;
+int storeTtlSec = 3600;     // a stored job nobody uses for this long is dropped, 0 = never
 
-int recveiveAll(SOCKET s, char* buffer, int length) 
+int recveiveAll(SOCKET s, char* buffer, int length)
 {
     int counter = 0;
     while (counter < length)
@@ -56,7 +357,7 @@ int recveiveAll(SOCKET s, char* buffer, int length)
     return counter;
 }
 
-int sendAll(SOCKET s, const char* data, int length) 
+int sendAll(SOCKET s, const char* data, int length)
 {
     int counter = 0;
     while (counter < length)
@@ -71,232 +372,2624 @@ int sendAll(SOCKET s, const char* data, int length)
     return counter;
 }
 
-bool sendCommand(SOCKET s, const string& cmd) 
+void putU32(string& out, uint32_t v)
+{
+    v = htonl(v);
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void putF64(string& out, double d)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    putU32(out, static_cast<uint32_t>(bits >> 32));
+    putU32(out, static_cast<uint32_t>(bits));
+}
+
+uint32_t getU32(const string& in, size_t& pos)
 {
-    if (cmd.size() > 256)
+    if (pos + 4 > in.size())
     {
-        return false;
+        throw runtime_error("truncated payload");
     }
-    CommandPacket pkt{};
-    pkt.length = htonl(static_cast<uint32_t>(cmd.size()));
-    memcpy(pkt.command, cmd.data(), cmd.size());
-    return sendAll(s, reinterpret_cast<char*>(&pkt), sizeof(pkt)) == sizeof(pkt);
+    uint32_t v;
+    memcpy(&v, in.data() + pos, sizeof(v));
+    pos += 4;
+    return ntohl(v);
+}
+
+void putU64(string& out, uint64_t v)
+{
+    putU32(out, static_cast<uint32_t>(v >> 32));
+    putU32(out, static_cast<uint32_t>(v));
+}
+
+uint64_t getU64(const string& in, size_t& pos)
+{
+    uint64_t hi = getU32(in, pos);
+    return hi << 32 | getU32(in, pos);
 }
 
-bool receiveCommand(SOCKET s, string& outCmd) 
+// Calls f(T()) with the C++ type behind `type`.
+template <typename F>
+void withElementType(uint32_t type, F&& f)
 {
-    CommandPacket pkt{};
-    if (recveiveAll(s, reinterpret_cast<char*>(&pkt), sizeof(pkt)) != sizeof(pkt))
+    switch (type)
     {
-        return false;
+    case ELEM_INT16: f(int16_t()); break;
+    case ELEM_INT32: f(int32_t()); break;
+    case ELEM_INT64: f(int64_t()); break;
+    case ELEM_FLOAT: f(float()); break;
+    default: throw runtime_error("unsupported element type");
     }
-    uint32_t len = ntohl(pkt.length);
-    if (len > 256)
+}
+
+// Row sums are kept wider than the cells so they cannot overflow: 64-bit for
+// integers, double for float. Either way they travel as 8 raw bytes.
+template <typename T>
+using Accumulator = typename conditional<is_floating_point<T>::value, double, int64_t>::type;
+
+// Products in MULTIPLY wrap modulo the cell width; doing them unsigned avoids
+// signed overflow (and int promotion for int16).
+template <typename T>
+using Wrap = typename conditional<is_floating_point<T>::value, T,
+    typename conditional<sizeof(T) <= 4, uint32_t, uint64_t>::type>::type;
+
+template <typename T>
+uint64_t accumulatorBits(Accumulator<T> v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+}
+
+template <typename T>
+Accumulator<T> accumulatorValue(uint64_t bits)
+{
+    Accumulator<T> v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// On the wire a cell is big-endian in its own width; a float as its bit pattern.
+template <typename T>
+void putCell(char* out, T v)
+{
+    typedef typename conditional<sizeof(T) == 2, uint16_t, typename conditional<sizeof(T) == 4, uint32_t, uint64_t>::type>::type Bits;
+    Bits bits;
+    memcpy(&bits, &v, sizeof(bits));
+    for (size_t b = 0; b < sizeof(T); ++b)
     {
-        return false;
+        out[b] = static_cast<char>(bits >> (8 * (sizeof(T) - 1 - b)));
     }
-    outCmd.assign(pkt.command, pkt.command + len);
-    return true;
 }
 
-void computeRange(vector<vector<int>>& m, int startRow, int endRow) 
+template <typename T>
+T getCell(const char* in)
 {
-    int n = static_cast<int>(m.size());
-    for (int i = startRow; i < endRow; ++i) 
+    typedef typename conditional<sizeof(T) == 2, uint16_t, typename conditional<sizeof(T) == 4, uint32_t, uint64_t>::type>::type Bits;
+    Bits bits = 0;
+    for (size_t b = 0; b < sizeof(T); ++b)
     {
-        int evenSum = 0;
-        for (int j = 0; j < n; ++j)
+        bits = static_cast<Bits>(bits << 8 | static_cast<unsigned char>(in[b]));
+    }
+    T v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// Decodes `count` wire cells of `type` into host order.
+void decodeCells(uint32_t type, const char* in, void* out, size_t count)
+{
+    withElementType(type, [&](auto zero)
         {
-            if (j % 2 == 0)
-            {
-                evenSum += m[i][j];
-            }        
+        typedef decltype(zero) T;
+        T* cells = static_cast<T*>(out);
+        for (size_t k = 0; k < count; ++k)
+        {
+            cells[k] = getCell<T>(in + k * sizeof(T));
         }
-        m[i][i] = evenSum;
-        this_thread::sleep_for(milliseconds(5));
-    }
+        });
+}
+
+void encodeCells(uint32_t type, const void* in, size_t count, string& out)
+{
+    size_t at = out.size();
+    out.resize(at + count * elementSize(type));
+    withElementType(type, [&](auto zero)
+        {
+        typedef decltype(zero) T;
+        const T* cells = static_cast<const T*>(in);
+        for (size_t k = 0; k < count; ++k)
+        {
+            putCell<T>(&out[at + k * sizeof(T)], cells[k]);
+        }
+        });
 }
 
-void computeMatrix(vector<vector<int>>& m, int threads) 
+// Collects several frames so they go out in a single send().
+struct FrameBatch
 {
-    if (threads <= 1) 
+    string buffer;
+
+    void add(uint8_t type, uint32_t id, const string& payload = string())
     {
-        computeRange(m, 0, static_cast<int>(m.size()));
-        return;
+        putU32(buffer, static_cast<uint32_t>(payload.size()));
+        buffer.push_back(static_cast<char>(type));
+        putU32(buffer, id);
+        buffer += payload;
     }
 
-    int n = static_cast<int>(m.size());
-    int base = n / threads;
-    int remainder = n % threads;
-    int startRow = 0;
-    vector<thread> pool;
-
-    for (int t = 0; t < threads; ++t) 
+    bool flush(SOCKET s)
     {
-        int rows = base + (t < remainder ? 1 : 0);
-        int endRow = startRow + rows;
-        pool.emplace_back(computeRange, ref(m), startRow, endRow);
-        startRow = endRow;
+        bool ok = buffer.empty() || sendAll(s, buffer.data(), static_cast<int>(buffer.size())) == static_cast<int>(buffer.size());
+        buffer.clear();
+        return ok;
     }
+};
 
-    for (auto& th : pool)
-    { 
-        th.join();
+// Largest payload the server accepts for each frame type. Uploads frame only
+// their header: the cells follow outside the frame.
+uint32_t maxPayload(uint8_t type)
+{
+    switch (type)
+    {
+    case MSG_COMPUTE_BLOCK:
+    case MSG_BLOCK_RESULT:
+        return MAX_BLOCK_PAYLOAD;
+    default:
+        return MAX_CONTROL_PAYLOAD;
     }
 }
 
-void serveClient(SOCKET cs) 
+// Buffers incoming bytes so that small batched frames are parsed without a recv() per field.
+struct FrameReader
 {
-    ClientTask& d = clients_list[cs];
+    SOCKET s;
+    vector<char> buffer = vector<char>(64 * 1024);
+    size_t begin = 0;
+    size_t end = 0;
+#ifndef _WIN32
+    deque<int> fds;     // descriptors that came with SCM_RIGHTS, in arrival order
+#endif
+
+    explicit FrameReader(SOCKET s) : s(s) {}
 
-    try 
+#ifndef _WIN32
+    ~FrameReader()
     {
-        string cmd;
-        while (receiveCommand(cs, cmd)) 
+        for (int fd : fds)
         {
-            cerr << "[c " << cs << "] " << cmd << '\n';
+            close(fd);
+        }
+    }
+#endif
 
-            if (cmd == "HELLO") 
-            {
-                sendCommand(cs, "WELCOME");
-            }
-            else if (cmd == "UPLOAD_MATRIX") 
+    int receive(char* dst, size_t len)
+    {
+#ifdef _WIN32
+        return recv(s, dst, static_cast<int>(len), 0);
+#else
+        iovec iov{ dst, len };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 4)];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(s, &msg, MSG_CMSG_CLOEXEC);
+        for (cmsghdr* c = n >= 0 ? CMSG_FIRSTHDR(&msg) : nullptr; c; c = CMSG_NXTHDR(&msg, c))
+        {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
             {
-                MatrixUploadInfo h{};
-                if (recveiveAll(cs, reinterpret_cast<char*>(&h), sizeof(h)) != sizeof(h))
-                { 
-                    throw runtime_error("header error");
-                }
-                int n = ntohl(h.matrix_size);
-                int cfgCnt = ntohl(h.num_threads);
-                int bytes = ntohl(h.matrix_bytes);
-                if (bytes != n * n * 4)
-                { 
-                    throw runtime_error("size mismatch");
-                }
-                d.cfg.resize(cfgCnt);
-                if (recveiveAll(cs, reinterpret_cast<char*>(d.cfg.data()), cfgCnt * 4) != cfgCnt * 4)
+                size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (size_t i = 0; i < count; ++i)
                 {
-                    throw runtime_error("config read error");
-                }
-                for (int& v : d.cfg) 
-                { 
-                    v = ntohl(v);
-                }
-                vector<int> flat(n * n);
-                if (recveiveAll(cs, reinterpret_cast<char*>(flat.data()), bytes) != bytes)
-                { 
-                    throw runtime_error("matrix data error");
+                    int fd;
+                    memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(fd));
+                    fds.push_back(fd);
                 }
-                d.matrix.assign(n, vector<int>(n));
-                for (int i = 0; i < n; ++i)
-                { 
-                    for (int j = 0; j < n; ++j)
-                    { 
-                        d.matrix[i][j] = ntohl(flat[i * n + j]);
-                    }
-                }
-                sendCommand(cs, "MATRIX_RECEIVED");
             }
-            else if (cmd == "START_PROCESSING") 
-            {
-                if (d.matrix.empty()) 
-                {
-                    sendCommand(cs, "ERROR: NO DATA");
-                    continue;
-                }
-
-                d.isProcessing = 1;
-                d.time_res.clear();
-                d.idx = 0;
-                sendCommand(cs, "PROCESSING_STARTED");
-
-                thread([cs]() 
-                    {
-                    ClientTask& ct = clients_list[cs];
-                    for (size_t i = 0; i < ct.cfg.size(); ++i) 
-                    {
-                        ct.idx = i;
-                        int thr = ct.cfg[i];
-
-                        auto copy = ct.matrix;
-                        auto t0 = high_resolution_clock::now();
-                        computeMatrix(copy, thr);
-                        double seconds = duration<double>(high_resolution_clock::now() - t0).count();
-
-                        ct.time_res.push_back(seconds);
-                        sendCommand(cs, "INFO: threads=" + to_string(thr) + ",time=" + to_string(seconds));
+        }
+        return static_cast<int>(n);
+#endif
+    }
 
-                    }
-                    ct.isProcessing = 0;
-                    sendCommand(cs, "PROCESSING_COMPLETED");
-                    }).detach();
+    bool fill(size_t need)
+    {
+        if (end - begin >= need)
+        {
+            return true;
+        }
+        if (begin > 0)
+        {
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        while (end < need)
+        {
+            int n = receive(buffer.data() + end, buffer.size() - end);
+            if (n <= 0)
+            {
+                return false;
+            }
+            end += n;
+        }
+        return true;
+    }
 
+    // raw bytes following a frame (the cells of an upload)
+    bool readBody(char* dst, size_t len)
+    {
+        size_t buffered = min(len, end - begin);
+        memcpy(dst, buffer.data() + begin, buffered);
+        begin += buffered;
+        for (size_t at = buffered; at < len;)
+        {
+            int chunk = static_cast<int>(min<size_t>(len - at, 1u << 30));
+            if (recveiveAll(s, dst + at, chunk) != chunk)
+            {
+                return false;
             }
-            else if (cmd == "REQUEST_STATUS") 
+            at += chunk;
+        }
+        return true;
+    }
+
+    bool skip(uint64_t len)
+    {
+        while (len > 0)
+        {
+            if (!fill(1))
             {
-                if (!d.isProcessing)
-                {
-                    sendCommand(cs, "status — FINISHED");
-                }
-                else
-                { 
-                    sendCommand(cs, "status — " + to_string(d.idx + 1) + "/" + to_string(d.cfg.size()));
-                }
+                return false;
             }
-            else if (cmd == "REQUEST_RESULTS") 
+            size_t n = static_cast<size_t>(min<uint64_t>(len, end - begin));
+            begin += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    bool read(uint8_t& type, uint32_t& id, string& payload)
+    {
+        if (!fill(FRAME_HEADER_SIZE))
+        {
+            return false;
+        }
+        uint32_t len;
+        memcpy(&len, buffer.data() + begin, sizeof(len));
+        len = ntohl(len);
+        type = static_cast<uint8_t>(buffer[begin + 4]);
+        memcpy(&id, buffer.data() + begin + 5, sizeof(id));
+        id = ntohl(id);
+        begin += FRAME_HEADER_SIZE;
+        if (len > maxPayload(type))
+        {
+            return false;
+        }
+
+        size_t buffered = min<size_t>(len, end - begin);
+        payload.assign(buffer.data() + begin, buffered);
+        begin += buffered;
+        // the payload grows with what has arrived, so a length prefix alone allocates nothing
+        while (payload.size() < len)
+        {
+            size_t at = payload.size();
+            size_t chunk = min<size_t>({ len - at, max<size_t>(at, 1u << 20), 1u << 30 });
+            payload.resize(at + chunk);
+            if (recveiveAll(s, &payload[at], static_cast<int>(chunk)) != static_cast<int>(chunk))
             {
-                string report = "RESULT:\nMatrix " + to_string(d.matrix.size()) + "x" + to_string(d.matrix.size());
-                for (size_t i = 0; i < d.cfg.size(); ++i)
-                { 
-                    report += "\n" + to_string(d.cfg[i]) + " threads: " + to_string(d.time_res[i]) + " s";
-                }
-                sendCommand(cs, report);
+                return false;
             }
         }
+        return true;
+    }
+};
+
+// Sends on the calling thread; frames posted earlier go out first. `body` sends
+// what follows the frames (a matrix's cells) while the send lock is still held.
+bool sendBatch(Session& s, FrameBatch& batch, const function<bool()>& body = nullptr)
+{
+    lock_guard<mutex> lock(s.sendMtx);
+    if (!s.connected)
+    {
+        batch.buffer.clear();
+        return false;
     }
-    catch (const exception& e) 
     {
-        cerr << "[s] exception: " << e.what() << '\n';
+        lock_guard<mutex> out(s.outMtx);
+        batch.buffer.insert(0, s.outbox);
+        s.outbox.clear();
     }
+    return batch.flush(s.sock) && (!body || body());
+}
 
-    closesocket(cs);
-    clients_list.erase(cs);
+bool sendFrame(Session& s, uint8_t type, uint32_t id, const string& payload = string())
+{
+    FrameBatch batch;
+    batch.add(type, id, payload);
+    return sendBatch(s, batch);
+}
+
+// For compute workers: hands the frames to the session's writer thread, so a
+// client that stops reading never holds up a worker or the cores it reserved.
+void postBatch(Session& s, FrameBatch& batch)
+{
+    {
+        lock_guard<mutex> lock(s.outMtx);
+        if (s.connected)
+        {
+            s.outbox += batch.buffer;
+        }
+    }
+    batch.buffer.clear();
+    s.outCv.notify_one();
 }
 
-int main() 
+void postFrame(Session& s, uint8_t type, uint32_t id, const string& payload = string())
 {
+    FrameBatch batch;
+    batch.add(type, id, payload);
+    postBatch(s, batch);
+}
 
-    WSADATA wsa{};
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) 
+// The writer thread of a connection: flushes what workers posted until it closes.
+void sessionWriter(shared_ptr<Session> session)
+{
+    Session& s = *session;
+    unique_lock<mutex> lock(s.outMtx);
+    while (true)
     {
-        cerr << "[ERROR] WSAStartup failed\n";
-        return 1;
+        s.outCv.wait(lock, [&]() { return !s.outbox.empty() || s.closing; });
+        if (s.closing)
+        {
+            return;
+        }
+        lock.unlock();
+        FrameBatch none;
+        sendBatch(s, none);
+        lock.lock();
     }
+}
 
-    SOCKET serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket == INVALID_SOCKET)
+#ifndef _WIN32
+// Maps a client's memfd read-only. Compute never writes the cells, so a local
+// upload costs only page-table updates. The seals guarantee the client can neither shrink the file under us (SIGBUS) nor
+// change cells after we hashed them.
+unique_ptr<MappedMatrix> mapShared(int fd, size_t bytes)
+{
+    struct stat st{};
+    int seals = fcntl(fd, F_GET_SEALS);
+    const int required = F_SEAL_SHRINK | F_SEAL_WRITE;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < bytes || seals < 0 || (seals & required) != required)
     {
-        cerr << "[ERROR] socket() failed\n";
-        WSACleanup();
-        return 1;
+        close(fd);
+        throw runtime_error("shared matrix must be a sealed memfd of the announced size");
     }
+    void* base = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        throw runtime_error("mmap of shared matrix failed");
+    }
+    auto m = make_unique<MappedMatrix>();
+    m->base = base;
+    m->bytes = bytes;
+    return m;
+}
 
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(12345);
-    addr.sin_addr.s_addr = INADDR_ANY;
+// The store keeps a job's cells in a file mapped MAP_SHARED: the kernel can write
+// cold pages back and drop them, so resident memory stays near the blocks in use.
+unique_ptr<MappedMatrix> createStoredMatrix(uint32_t jobId, size_t bytes)
+{
+    string path = storeDir + "/job-" + to_string(jobId) + ".mat";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        throw runtime_error("cannot create " + path);
+    }
+    void* base = ftruncate(fd, bytes) == 0 ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        unlink(path.c_str());
+        throw runtime_error("cannot map " + path);
+    }
+    madvise(base, bytes, MADV_SEQUENTIAL);
+    auto m = make_unique<MappedMatrix>();
+    m->base = base;
+    m->bytes = bytes;
+    m->path = path;
+    return m;
+}
 
-    if (bind(serverSocket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) 
+// Unmaps the resident pages of a stored job between uploads and runs; they stay
+// in the page cache (dirty ones get written back) until memory is needed.
+void releaseStored(ClientTask& ct)
+{
+    if (ct.jobId != 0)
     {
-        cerr << "[ERROR] bind() failed\n";
-        closesocket(serverSocket);
-        WSACleanup();
-        return 1;
+        madvise(ct.mapped->base, ct.mapped->bytes, MADV_DONTNEED);
     }
-  
-    listen(serverSocket, SOMAXCONN);
-    cerr << "[s] Listening on port 12345\n";
+}
+
+// Applies `advice` to the whole pages inside rows [from, to) of a stored matrix.
+void adviseRows(const void* m, size_t rowBytes, int firstRow, int from, int to, int advice)
+{
+    static const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    uintptr_t begin = reinterpret_cast<uintptr_t>(m) + static_cast<size_t>(from - firstRow) * rowBytes;
+    uintptr_t end = reinterpret_cast<uintptr_t>(m) + static_cast<size_t>(to - firstRow) * rowBytes;
+    begin = (begin + page - 1) & ~(page - 1);
+    end &= ~(page - 1);
+    if (begin < end)
+    {
+        madvise(reinterpret_cast<void*>(begin), end - begin, advice);
+    }
+}
+#endif
+
+// Opt-in timeline (--trace FILE). Every thread appends to its own ring holding
+// its last TRACE_RING_EVENTS events, stamped with the TSC, so recording takes no
+// lock and no syscall; with tracing off it is one relaxed load. The rings are
+// written as Chrome Trace Event JSON (Perfetto, chrome://tracing) by a thread of
+// their own once the scheduler has been idle for TRACE_QUIET_MS. Events a busy
+// thread overwrites while the rings are copied are dropped, not written torn.
+const size_t TRACE_RING_EVENTS = 1 << 14;
+const int TRACE_QUIET_MS = 500;
+
+struct TraceEvent
+{
+    uint64_t tsc;
+    const char* name;
+    const char* argName;    // nullptr = no argument
+    uint64_t arg;
+    uint32_t tid;
+    char phase;             // 'B' begin, 'E' end, 'i' instant
+};
+
+// A ring slot is read by the trace writer while its thread may be reusing it,
+// so every field is a relaxed atomic; `written` orders them like a seqlock.
+struct TraceSlot
+{
+    atomic<uint64_t> tsc{ 0 };
+    atomic<const char*> name{ nullptr };
+    atomic<const char*> argName{ nullptr };
+    atomic<uint64_t> arg{ 0 };
+    atomic<uint32_t> tid{ 0 };
+    atomic<char> phase{ 0 };
+
+    void store(const TraceEvent& e)
+    {
+        tsc.store(e.tsc, memory_order_relaxed);
+        name.store(e.name, memory_order_relaxed);
+        argName.store(e.argName, memory_order_relaxed);
+        arg.store(e.arg, memory_order_relaxed);
+        tid.store(e.tid, memory_order_relaxed);
+        phase.store(e.phase, memory_order_relaxed);
+    }
+
+    TraceEvent load() const
+    {
+        return { tsc.load(memory_order_relaxed), name.load(memory_order_relaxed), argName.load(memory_order_relaxed),
+            arg.load(memory_order_relaxed), tid.load(memory_order_relaxed), phase.load(memory_order_relaxed) };
+    }
+};
+
+struct TraceRing
+{
+    unique_ptr<TraceSlot[]> events{ new TraceSlot[TRACE_RING_EVENTS] };
+    atomic<uint64_t> written{ 0 };      // events ever stored; slot k % size holds event k
+};
+
+atomic<bool> tracing{ false };
+string traceFile;
+mutex traceMtx;     // guards traceRings, freeRings and traceDumpWanted
+condition_variable traceCv;
+bool traceDumpWanted = false;
+vector<unique_ptr<TraceRing>> traceRings;
+vector<TraceRing*> freeRings;
+uint32_t nextTraceTid = 1;
+uint64_t traceTsc0 = 0;
+steady_clock::time_point traceClock0;
+
+inline uint64_t readTsc()
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+void startTrace(const string& file)
+{
+    traceFile = file;
+    traceTsc0 = readTsc();
+    traceClock0 = steady_clock::now();
+    tracing = true;
+}
+
+// Connection threads come and go; an exiting thread hands its ring (and the
+// events in it) to the next new thread instead of leaving it behind.
+struct TraceThread
+{
+    TraceRing* ring = nullptr;
+    uint32_t tid = 0;
+
+    ~TraceThread()
+    {
+        if (ring)
+        {
+            lock_guard<mutex> lock(traceMtx);
+            freeRings.push_back(ring);
+        }
+    }
+};
+
+void traceEvent(char phase, const char* name, const char* argName = nullptr, uint64_t arg = 0)
+{
+    if (!tracing.load(memory_order_relaxed))
+    {
+        return;
+    }
+    thread_local TraceThread self;
+    if (!self.ring)
+    {
+        lock_guard<mutex> lock(traceMtx);
+        if (freeRings.empty())
+        {
+            traceRings.push_back(make_unique<TraceRing>());
+            self.ring = traceRings.back().get();
+        }
+        else
+        {
+            self.ring = freeRings.back();
+            freeRings.pop_back();
+        }
+        self.tid = nextTraceTid++;
+    }
+    // seqlock writer: a reader that sees any of this slot's new fields also sees
+    // written == k (fence), and one that sees k + 1 sees all of them (release)
+    uint64_t k = self.ring->written.load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    self.ring->events[k % TRACE_RING_EVENTS].store({ readTsc(), name, argName, arg, self.tid, phase });
+    self.ring->written.store(k + 1, memory_order_release);
+}
+
+struct TraceScope
+{
+    const char* name;
+
+    TraceScope(const char* name, const char* argName = nullptr, uint64_t arg = 0) : name(name)
+    {
+        traceEvent('B', name, argName, arg);
+    }
+
+    ~TraceScope()
+    {
+        traceEvent('E', name);
+    }
+};
+
+// Only the trace writer thread, or main once nothing else runs, calls this.
+void dumpTrace()
+{
+    if (!tracing)
+    {
+        return;
+    }
+    vector<TraceEvent> events;
+    {
+        lock_guard<mutex> lock(traceMtx);
+        for (auto& ring : traceRings)
+        {
+            uint64_t end = ring->written.load(memory_order_acquire);
+            uint64_t begin = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+            size_t copied = events.size();
+            for (uint64_t k = begin; k < end; ++k)
+            {
+                events.push_back(ring->events[k % TRACE_RING_EVENTS].load());
+            }
+            // seqlock reader: re-check written after the copy. Slot k is reused once
+            // written reaches k + TRACE_RING_EVENTS; drop what may have been
+            atomic_thread_fence(memory_order_acquire);
+            uint64_t now = ring->written.load(memory_order_relaxed);
+            uint64_t safe = now > TRACE_RING_EVENTS ? now - TRACE_RING_EVENTS + 1 : 0;
+            if (safe > begin)
+            {
+                events.erase(events.begin() + copied, events.begin() + copied + static_cast<size_t>(min(safe, end) - begin));
+            }
+        }
+    }
+    // TSC ticks per microsecond, measured over the whole trace
+    double us = duration<double, micro>(steady_clock::now() - traceClock0).count();
+    double ticksPerUs = us > 0 ? static_cast<double>(readTsc() - traceTsc0) / us : 1;
+    ofstream out(traceFile);
+    out << fixed << setprecision(3) << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    const char* sep = "\n";
+    for (const TraceEvent& e : events)
+    {
+        out << sep << "{\"name\":\"" << e.name << "\",\"ph\":\"" << e.phase << "\",\"ts\":" << static_cast<double>(e.tsc - traceTsc0) / ticksPerUs
+            << ",\"pid\":1,\"tid\":" << e.tid;
+        if (e.phase == 'i')
+        {
+            out << ",\"s\":\"t\"";
+        }
+        if (e.argName)
+        {
+            out << ",\"args\":{\"" << e.argName << "\":" << e.arg << "}";
+        }
+        out << "}";
+        sep = ",\n";
+    }
+    out << "\n]}\n";
+    if (!out)
+    {
+        cerr << "[ERROR] cannot write " << traceFile << "\n";
+    }
+}
+
+// Called by the scheduler when it runs out of jobs; the writing is left to traceWriter.
+void requestTraceDump()
+{
+    if (!tracing)
+    {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(traceMtx);
+        traceDumpWanted = true;
+    }
+    traceCv.notify_one();
+}
+
+// Writes the trace once the scheduler has stayed idle for TRACE_QUIET_MS, so a
+// burst of short jobs costs one write and the workers have stopped tracing.
+void traceWriter()
+{
+    unique_lock<mutex> lock(traceMtx);
+    while (true)
+    {
+        traceCv.wait(lock, []() { return traceDumpWanted; });
+        do
+        {
+            traceDumpWanted = false;
+        } while (traceCv.wait_for(lock, milliseconds(TRACE_QUIET_MS), []() { return traceDumpWanted; }));
+        lock.unlock();
+        if (scheduler->idle())
+        {
+            dumpTrace();
+        }
+        lock.lock();
+    }
+}
+
+ComputePool::ComputePool(unsigned threads)
+{
+    for (unsigned i = 0; i < max(1u, threads); ++i)
+    {
+        workers.emplace_back(&ComputePool::workerFunction, this);
+    }
+}
+
+ComputePool::~ComputePool()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        stop = true;
+    }
+    cv.notify_all();
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void ComputePool::addTask(function<void()> task)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        tasks.push(move(task));
+        traceEvent('i', "enqueue", "queued", tasks.size());
+    }
+    cv.notify_one();
+}
+
+void ComputePool::workerFunction()
+{
+    while (true)
+    {
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [&] { return stop || !tasks.empty(); });
+        if (tasks.empty())
+        {
+            break;
+        }
+        auto task = move(tasks.front());
+        tasks.pop();
+        lock.unlock();
+        TraceScope span("task");
+        task();
+    }
+}
+
+// 64-bit multiply-xorshift over 4 independent lanes; only has to be fast and
+// well-mixed, not cryptographic.
+struct MatrixHasher
+{
+    uint64_t lanes[4] = { 0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL };
+    size_t count = 0;
+
+    void add(uint32_t v)
+    {
+        uint64_t& h = lanes[count++ & 3];
+        h = (h ^ v) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 29;
+    }
+
+    // raw cells in host order, as 32-bit words; a short tail is zero-padded
+    void addBytes(const void* data, size_t bytes)
+    {
+        const char* p = static_cast<const char*>(data);
+        for (size_t k = 0; k + 4 <= bytes; k += 4)
+        {
+            uint32_t v;
+            memcpy(&v, p + k, 4);
+            add(v);
+        }
+        if (bytes % 4 != 0)
+        {
+            uint32_t v = 0;
+            memcpy(&v, p + bytes / 4 * 4, bytes % 4);
+            add(v);
+        }
+    }
+
+    uint64_t finish() const
+    {
+        uint64_t h = count;
+        for (uint64_t lane : lanes)
+        {
+            h = (h ^ lane) * 0xC4CEB9FE1A85EC53ULL;
+            h ^= h >> 32;
+        }
+        return h;
+    }
+};
+
+bool ResultCache::lookup(uint64_t hash, int n, CachedResult& out)
+{
+    lock_guard<mutex> lock(mtx);
+    auto it = index.find(hash);
+    if (it == index.end() || it->second->result.n != n)
+    {
+        return false;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    out = it->second->result;
+    return true;
+}
+
+void ResultCache::store(uint64_t hash, int n, int threads, double seconds, const vector<uint64_t>& diagonal)
+{
+    lock_guard<mutex> lock(mtx);
+    auto it = index.find(hash);
+    if (it == index.end())
+    {
+        lru.push_front(Entry{ hash, CachedResult{}, 0 });
+        it = index.emplace(hash, lru.begin()).first;
+    }
+    else
+    {
+        lru.splice(lru.begin(), lru, it->second);
+    }
+
+    Entry& e = *it->second;
+    usedBytes -= e.bytes;
+    e.result.n = n;
+    if (e.result.diagonal.empty())
+    {
+        e.result.diagonal = diagonal;
+    }
+    e.result.seconds[threads] = seconds;
+    e.bytes = sizeof(Entry) + e.result.diagonal.size() * sizeof(uint64_t) + e.result.seconds.size() * 32;
+    usedBytes += e.bytes;
+
+    while (usedBytes > maxBytes && lru.size() > 1)
+    {
+        usedBytes -= lru.back().bytes;
+        index.erase(lru.back().hash);
+        lru.pop_back();
+    }
+}
+
+int64_t nowNs()
+{
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Called from compute workers. Whoever wins the CAS on nextProgressNs sends the
+// frame; everybody else only pays for the atomic load.
+void reportProgress(ClientTask& ct, int n)
+{
+    uint32_t intervalMs = ct.progressIntervalMs.load(memory_order_relaxed);
+    if (intervalMs == 0)
+    {
+        return;
+    }
+    int64_t now = nowNs();
+    int64_t next = ct.nextProgressNs.load(memory_order_relaxed);
+    if (now < next || !ct.nextProgressNs.compare_exchange_strong(next, now + intervalMs * 1000000LL, memory_order_relaxed))
+    {
+        return;
+    }
+
+    int done = ct.rowsDone.load(memory_order_relaxed);
+    double elapsed = (now - ct.runStartNs.load(memory_order_relaxed)) / 1e9;
+    double rate = elapsed > 0 ? done / elapsed : 0;
+    double eta = rate > 0 ? (n - done) / rate : 0;
+
+    string payload;
+    putU32(payload, static_cast<uint32_t>(ct.idx + 1));
+    putU32(payload, static_cast<uint32_t>(ct.cfg.size()));
+    putU32(payload, static_cast<uint32_t>(done));
+    putU32(payload, static_cast<uint32_t>(n));
+    putF64(payload, rate);
+    putF64(payload, eta);
+
+    // never let progress pile up behind a slow socket; the next tick will retry
+    uint32_t ownerId;
+    shared_ptr<Session> owner = ct.owner(ownerId);
+    Session& s = *owner;
+    {
+        lock_guard<mutex> lock(s.outMtx);
+        if (!s.connected || !s.outbox.empty())
+        {
+            return;
+        }
+        FrameBatch batch;
+        batch.add(MSG_PROGRESS, ownerId, payload);
+        s.outbox.swap(batch.buffer);
+    }
+    s.outCv.notify_one();
+}
+
+// `m` holds rows [firstRow, ...) of an n x n matrix: all of it locally, one block
+// on a peer. Row i's even-column sum goes to sums[i - firstRow]; the cells are
+// never written, so there is nothing to restore between runs.
+template <typename T>
+void computeRange(const T* m, int n, int firstRow, int startRow, int endRow, uint64_t* sums, ClientTask* progress)
+{
+    int unreported = 0;
+#ifndef _WIN32
+    // stored matrices are streamed: fault the next block in early, release the one behind
+    bool streamed = progress && progress->jobId != 0;
+    size_t rowBytes = static_cast<size_t>(n) * sizeof(T);
+    int blockRows = static_cast<int>(max<size_t>(1, STORE_BLOCK_BYTES / rowBytes));
+#endif
+    TraceScope span("rows", "first", static_cast<uint64_t>(startRow));
+    for (int i = startRow; i < endRow; ++i)
+    {
+#ifndef _WIN32
+        if (streamed && (i - startRow) % blockRows == 0)
+        {
+            int next = min(endRow, i + blockRows);
+            adviseRows(m, rowBytes, firstRow, next, min(endRow, next + blockRows), MADV_WILLNEED);
+            if (i > startRow)
+            {
+                adviseRows(m, rowBytes, firstRow, max(startRow, i - blockRows), i, MADV_DONTNEED);
+            }
+        }
+#endif
+        const T* row = m + static_cast<size_t>(i - firstRow) * n;
+        Accumulator<T> evenSum = 0;
+        for (int j = 0; j < n; j += 2)
+        {
+            evenSum += row[j];
+        }
+        sums[i - firstRow] = accumulatorBits<T>(evenSum);
+        if (rowDelayMs > 0)
+        {
+            this_thread::sleep_for(milliseconds(rowDelayMs));
+        }
+        // publish in small batches so workers do not fight over the counter's cache line
+        if (progress && (++unreported == 16 || i + 1 == endRow))
+        {
+            progress->rowsDone.fetch_add(unreported, memory_order_relaxed);
+            unreported = 0;
+            reportProgress(*progress, n);
+        }
+    }
+}
+
+// Splits rows [firstRow, firstRow + rows) into `parts` blocks and runs them on the
+// shared pool; the last block to finish calls onDone from its worker thread.
+void computeMatrixAsync(uint32_t type, const void* m, int n, int firstRow, int rows, int parts, uint64_t* sums, ClientTask* progress, function<void()> onDone)
+{
+    parts = max(1, min(parts, rows));
+    int base = rows / parts;
+    int remainder = rows % parts;
+    int startRow = firstRow;
+
+    auto pending = make_shared<atomic<int>>(parts);
+    auto done = make_shared<function<void()>>(move(onDone));
+
+    for (int t = 0; t < parts; ++t)
+    {
+        int endRow = startRow + base + (t < remainder ? 1 : 0);
+        computePool->addTask([=]()
+            {
+            withElementType(type, [&](auto zero)
+                {
+                typedef decltype(zero) T;
+                computeRange(static_cast<const T*>(m), n, firstRow, startRow, endRow, sums, progress);
+                });
+            if (pending->fetch_sub(1) == 1)
+            {
+                (*done)();
+            }
+            });
+        startRow = endRow;
+    }
+}
+
+// Operations other than the diagonal benchmark. Each one reads operand tasks of
+// the session and fills a new task with the n x n result; the work is cut into
+// tiles that compute workers pull from a shared counter. Integer arithmetic wraps
+// modulo the cell width, the same in the SIMD and the scalar kernels.
+// The AVX2 kernels (int32 and float) are used when the build targets it
+// (-mavx2 or /arch:AVX2); other types and builds take the scalar templates.
+
+const int MUL_MC = 64;      // rows of C per tile: the A block stays in L1/L2
+const int MUL_KC = 256;     // depth of one pass: a KC x NC block of B fits in L2
+const int MUL_NC = 256;
+const int TRANSPOSE_TILE = 64;
+
+typedef void (*TileKernel)(const void* const* in, void* out, int n, int tile);
+
+struct Operation
+{
+    const char* name;
+    int operands;
+    int (*tiles)(int n);
+    TileKernel kernels[4];      // by element type, ELEM_INT16 first
+};
+
+// Runs tiles [0, tiles) on up to `threads` pool workers; the last worker to run
+// out of tiles calls onDone.
+void parallelTiles(int tiles, int threads, function<void(int)> body, function<void()> onDone)
+{
+    int workers = max(1, min(threads, tiles));
+    auto next = make_shared<atomic<int>>(0);
+    auto pending = make_shared<atomic<int>>(workers);
+    auto shared = make_shared<pair<function<void(int)>, function<void()>>>(move(body), move(onDone));
+    for (int w = 0; w < workers; ++w)
+    {
+        computePool->addTask([=]()
+            {
+            for (int t = next->fetch_add(1); t < tiles; t = next->fetch_add(1))
+            {
+                TraceScope span("tile", "tile", static_cast<uint64_t>(t));
+                shared->first(t);
+            }
+            if (pending->fetch_sub(1) == 1)
+            {
+                shared->second();
+            }
+            });
+    }
+}
+
+// C[i0..i0+4)[j0..j0+16) += A[..][k0..k1) * B[k0..k1)[..]; the 4x16 block stays in registers.
+template <typename T>
+inline void multiplyMicro4x16(const T* a, const T* b, T* c, int n, int k0, int k1)
+{
+    Wrap<T> acc[4][16];
+    for (int r = 0; r < 4; ++r)
+    {
+        for (int j = 0; j < 16; ++j)
+        {
+            acc[r][j] = static_cast<Wrap<T>>(c[static_cast<size_t>(r) * n + j]);
+        }
+    }
+    for (int k = k0; k < k1; ++k)
+    {
+        const T* bk = b + static_cast<size_t>(k) * n;
+        for (int r = 0; r < 4; ++r)
+        {
+            Wrap<T> av = static_cast<Wrap<T>>(a[static_cast<size_t>(r) * n + k]);
+            for (int j = 0; j < 16; ++j)
+            {
+                acc[r][j] += av * static_cast<Wrap<T>>(bk[j]);
+            }
+        }
+    }
+    for (int r = 0; r < 4; ++r)
+    {
+        for (int j = 0; j < 16; ++j)
+        {
+            c[static_cast<size_t>(r) * n + j] = static_cast<T>(acc[r][j]);
+        }
+    }
+}
+
+#ifdef __AVX2__
+template <>
+inline void multiplyMicro4x16<int32_t>(const int32_t* a, const int32_t* b, int32_t* c, int n, int k0, int k1)
+{
+    __m256i acc[4][2];
+    for (int r = 0; r < 4; ++r)
+    {
+        acc[r][0] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(c + static_cast<size_t>(r) * n));
+        acc[r][1] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(c + static_cast<size_t>(r) * n + 8));
+    }
+    for (int k = k0; k < k1; ++k)
+    {
+        const int32_t* bk = b + static_cast<size_t>(k) * n;
+        __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bk));
+        __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bk + 8));
+        for (int r = 0; r < 4; ++r)
+        {
+            __m256i av = _mm256_set1_epi32(a[static_cast<size_t>(r) * n + k]);
+            acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_mullo_epi32(av, b0));
+            acc[r][1] = _mm256_add_epi32(acc[r][1], _mm256_mullo_epi32(av, b1));
+        }
+    }
+    for (int r = 0; r < 4; ++r)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(c + static_cast<size_t>(r) * n), acc[r][0]);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(c + static_cast<size_t>(r) * n + 8), acc[r][1]);
+    }
+}
+
+// separate multiply and add (no FMA) so results match the scalar kernel bit for bit
+template <>
+inline void multiplyMicro4x16<float>(const float* a, const float* b, float* c, int n, int k0, int k1)
+{
+    __m256 acc[4][2];
+    for (int r = 0; r < 4; ++r)
+    {
+        acc[r][0] = _mm256_loadu_ps(c + static_cast<size_t>(r) * n);
+        acc[r][1] = _mm256_loadu_ps(c + static_cast<size_t>(r) * n + 8);
+    }
+    for (int k = k0; k < k1; ++k)
+    {
+        const float* bk = b + static_cast<size_t>(k) * n;
+        __m256 b0 = _mm256_loadu_ps(bk);
+        __m256 b1 = _mm256_loadu_ps(bk + 8);
+        for (int r = 0; r < 4; ++r)
+        {
+            __m256 av = _mm256_set1_ps(a[static_cast<size_t>(r) * n + k]);
+            acc[r][0] = _mm256_add_ps(acc[r][0], _mm256_mul_ps(av, b0));
+            acc[r][1] = _mm256_add_ps(acc[r][1], _mm256_mul_ps(av, b1));
+        }
+    }
+    for (int r = 0; r < 4; ++r)
+    {
+        _mm256_storeu_ps(c + static_cast<size_t>(r) * n, acc[r][0]);
+        _mm256_storeu_ps(c + static_cast<size_t>(r) * n + 8, acc[r][1]);
+    }
+}
+#endif
+
+// Edge cells the 4x16 kernel does not cover.
+template <typename T>
+void multiplyScalar(const T* a, const T* b, T* c, int n, int i0, int i1, int j0, int j1, int k0, int k1)
+{
+    for (int i = i0; i < i1; ++i)
+    {
+        for (int j = j0; j < j1; ++j)
+        {
+            Wrap<T> sum = static_cast<Wrap<T>>(c[static_cast<size_t>(i) * n + j]);
+            for (int k = k0; k < k1; ++k)
+            {
+                sum += static_cast<Wrap<T>>(a[static_cast<size_t>(i) * n + k]) * static_cast<Wrap<T>>(b[static_cast<size_t>(k) * n + j]);
+            }
+            c[static_cast<size_t>(i) * n + j] = static_cast<T>(sum);
+        }
+    }
+}
+
+int multiplyTiles(int n)
+{
+    return (n + MUL_MC - 1) / MUL_MC;
+}
+
+// One tile = MUL_MC rows of C, built up in KC x NC blocks of B.
+template <typename T>
+void multiplyTile(const void* const* in, void* out, int n, int tile)
+{
+    const T* a = static_cast<const T*>(in[0]);
+    const T* b = static_cast<const T*>(in[1]);
+    T* c = static_cast<T*>(out);
+    int i0 = tile * MUL_MC;
+    int i1 = min(n, i0 + MUL_MC);
+    int i4 = i0 + (i1 - i0) / 4 * 4;
+    for (int k0 = 0; k0 < n; k0 += MUL_KC)
+    {
+        int k1 = min(n, k0 + MUL_KC);
+        for (int j0 = 0; j0 < n; j0 += MUL_NC)
+        {
+            int j1 = min(n, j0 + MUL_NC);
+            int j16 = j0 + (j1 - j0) / 16 * 16;
+            for (int i = i0; i < i4; i += 4)
+            {
+                for (int j = j0; j < j16; j += 16)
+                {
+                    multiplyMicro4x16(a + static_cast<size_t>(i) * n, b + j, c + static_cast<size_t>(i) * n + j, n, k0, k1);
+                }
+            }
+            multiplyScalar(a, b, c, n, i0, i4, j16, j1, k0, k1);
+            multiplyScalar(a, b, c, n, i4, i1, j0, j1, k0, k1);
+        }
+    }
+}
+
+int transposeTiles(int n)
+{
+    return (n + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+}
+
+#ifdef __AVX2__
+// 8x8 block of 32-bit cells in registers: interleave 32-bit, then 64-bit, then swap 128-bit halves.
+inline void transpose8x8(const void* src, void* dst, int n)
+{
+    const int32_t* s = static_cast<const int32_t*>(src);
+    int32_t* d = static_cast<int32_t*>(dst);
+    __m256i r[8];
+    for (int k = 0; k < 8; ++k)
+    {
+        r[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + static_cast<size_t>(k) * n));
+    }
+    __m256i t[8];
+    for (int k = 0; k < 8; k += 2)
+    {
+        t[k] = _mm256_unpacklo_epi32(r[k], r[k + 1]);
+        t[k + 1] = _mm256_unpackhi_epi32(r[k], r[k + 1]);
+    }
+    for (int k = 0; k < 8; k += 4)
+    {
+        r[k] = _mm256_unpacklo_epi64(t[k], t[k + 2]);
+        r[k + 1] = _mm256_unpackhi_epi64(t[k], t[k + 2]);
+        r[k + 2] = _mm256_unpacklo_epi64(t[k + 1], t[k + 3]);
+        r[k + 3] = _mm256_unpackhi_epi64(t[k + 1], t[k + 3]);
+    }
+    for (int k = 0; k < 4; ++k)
+    {
+        t[k] = _mm256_permute2x128_si256(r[k], r[k + 4], 0x20);
+        t[k + 4] = _mm256_permute2x128_si256(r[k], r[k + 4], 0x31);
+    }
+    for (int k = 0; k < 8; ++k)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + static_cast<size_t>(k) * n), t[k]);
+    }
+}
+#endif
+
+// One tile = a band of TRANSPOSE_TILE source rows, walked in square blocks so
+// both the reads and the scattered writes stay within a few pages.
+template <typename T>
+void transposeTile(const void* const* in, void* dst, int n, int tile)
+{
+    const T* src = static_cast<const T*>(in[0]);
+    T* out = static_cast<T*>(dst);
+    int i0 = tile * TRANSPOSE_TILE;
+    int i1 = min(n, i0 + TRANSPOSE_TILE);
+    for (int j0 = 0; j0 < n; j0 += TRANSPOSE_TILE)
+    {
+        int j1 = min(n, j0 + TRANSPOSE_TILE);
+        int i = i0;
+#ifdef __AVX2__
+        for (; sizeof(T) == 4 && i + 8 <= i1; i += 8)
+        {
+            int j = j0;
+            for (; j + 8 <= j1; j += 8)
+            {
+                transpose8x8(src + static_cast<size_t>(i) * n + j, out + static_cast<size_t>(j) * n + i, n);
+            }
+            for (; j < j1; ++j)
+            {
+                for (int k = 0; k < 8; ++k)
+                {
+                    out[static_cast<size_t>(j) * n + i + k] = src[static_cast<size_t>(i + k) * n + j];
+                }
+            }
+        }
+#endif
+        for (; i < i1; ++i)
+        {
+            for (int j = j0; j < j1; ++j)
+            {
+                out[static_cast<size_t>(j) * n + i] = src[static_cast<size_t>(i) * n + j];
+            }
+        }
+    }
+}
+
+enum OperationCode : uint32_t
+{
+    OP_TRANSPOSE = 1,
+    OP_MULTIPLY
+};
+
+const unordered_map<uint32_t, Operation> operations =
+{
+    { OP_TRANSPOSE, { "TRANSPOSE", 1, transposeTiles,
+        { transposeTile<int16_t>, transposeTile<int32_t>, transposeTile<int64_t>, transposeTile<float> } } },
+    { OP_MULTIPLY, { "MULTIPLY", 2, multiplyTiles,
+        { multiplyTile<int16_t>, multiplyTile<int32_t>, multiplyTile<int64_t>, multiplyTile<float> } } },
+};
+
+// Textbook loops, only for --bench-ops.
+template <typename T>
+void naiveMultiply(const T* a, const T* b, T* c, int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        for (int j = 0; j < n; ++j)
+        {
+            Wrap<T> sum = 0;
+            for (int k = 0; k < n; ++k)
+            {
+                sum += static_cast<Wrap<T>>(a[static_cast<size_t>(i) * n + k]) * static_cast<Wrap<T>>(b[static_cast<size_t>(k) * n + j]);
+            }
+            c[static_cast<size_t>(i) * n + j] = static_cast<T>(sum);
+        }
+    }
+}
+
+template <typename T>
+void naiveTranspose(const T* a, T* out, int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        for (int j = 0; j < n; ++j)
+        {
+            out[static_cast<size_t>(j) * n + i] = a[static_cast<size_t>(i) * n + j];
+        }
+    }
+}
+
+// Blocked kernels on the pool vs. the naive loops on one thread, same inputs.
+// Float cells are kept small so every sum is exact and the results must match.
+template <typename T>
+void benchOperations(uint32_t type, int n, int threads)
+{
+    vector<T> a(static_cast<size_t>(n) * n), b(a.size()), expected(a.size()), got(a.size());
+    int range = is_floating_point<T>::value ? 10 : 1000;
+    for (size_t k = 0; k < a.size(); ++k)
+    {
+        a[k] = static_cast<T>(rand() % range);
+        b[k] = static_cast<T>(rand() % range);
+    }
+    const void* in[2] = { a.data(), b.data() };
+    cout << "n=" << n << ", " << threads << " threads, " << sizeof(T) * 8 << "-bit " << (is_floating_point<T>::value ? "float" : "int")
+#ifdef __AVX2__
+        << ", AVX2"
+#else
+        << ", scalar"
+#endif
+        << "\n";
+    for (uint32_t code : { OP_TRANSPOSE, OP_MULTIPLY })
+    {
+        const Operation& op = operations.at(code);
+        TileKernel kernel = op.kernels[type - ELEM_INT16];
+        auto t0 = high_resolution_clock::now();
+        if (code == OP_MULTIPLY)
+        {
+            naiveMultiply(a.data(), b.data(), expected.data(), n);
+        }
+        else
+        {
+            naiveTranspose(a.data(), expected.data(), n);
+        }
+        double naive = duration<double>(high_resolution_clock::now() - t0).count();
+
+        fill(got.begin(), got.end(), T());
+        promise<void> done;
+        t0 = high_resolution_clock::now();
+        void* out = got.data();
+        parallelTiles(op.tiles(n), threads, [&in, out, n, kernel](int tile) { kernel(in, out, n, tile); }, [&done]() { done.set_value(); });
+        done.get_future().wait();
+        double blocked = duration<double>(high_resolution_clock::now() - t0).count();
+
+        cout << op.name << ": naive " << naive << " s, blocked " << blocked << " s, x" << naive / blocked
+            << (got == expected ? "" : "  MISMATCH") << "\n";
+    }
+}
+
+void setSocketTimeouts(SOCKET s, int ms)
+{
+#ifdef _WIN32
+    DWORD tv = ms;
+#else
+    timeval tv{ ms / 1000, (ms % 1000) * 1000 };
+#endif
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&tv), sizeof(tv));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&tv), sizeof(tv));
+}
+
+SOCKET connectPeer(const Peer& peer)
+{
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = nullptr;
+    if (getaddrinfo(peer.host.c_str(), peer.port.c_str(), &hints, &found) != 0)
+    {
+        return INVALID_SOCKET;
+    }
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s != INVALID_SOCKET && connect(s, found->ai_addr, static_cast<int>(found->ai_addrlen)) != 0)
+    {
+        closesocket(s);
+        s = INVALID_SOCKET;
+    }
+    freeaddrinfo(found);
+    if (s != INVALID_SOCKET)
+    {
+        setSocketTimeouts(s, PEER_TIMEOUT_MS);
+    }
+    return s;
+}
+
+// Row blocks of one distributed run. A block is either pending or owned by
+// exactly one peer; a peer that fails puts its block back before giving up.
+struct BlockQueue
+{
+    mutex mtx;
+    condition_variable cv;
+    deque<pair<int, int>> pending;     // first row, row count
+    int remaining = 0;
+    size_t alive = 0;
+};
+
+// Feeds one peer a block at a time until the queue is drained or the peer fails.
+void peerWorker(const Peer& peer, shared_ptr<BlockQueue> q, shared_ptr<ClientTask> ct, int threads)
+{
+    int n = ct->n;
+    size_t rowBytes = static_cast<size_t>(n) * elementSize(ct->type);
+    const char* cells = static_cast<const char*>(ct->cells());
+    SOCKET s = connectPeer(peer);
+    FrameReader reader{ s };
+    while (s != INVALID_SOCKET)
+    {
+        pair<int, int> block;
+        {
+            unique_lock<mutex> lock(q->mtx);
+            q->cv.wait(lock, [&]() { return !q->pending.empty() || q->remaining == 0; });
+            if (q->remaining == 0)
+            {
+                break;
+            }
+            block = q->pending.front();
+            q->pending.pop_front();
+        }
+
+        int first = block.first;
+        int rows = block.second;
+        FrameBatch request;
+        string payload;
+        payload.reserve(20 + rows * rowBytes);
+        putU32(payload, n);
+        putU32(payload, first);
+        putU32(payload, rows);
+        putU32(payload, threads);
+        putU32(payload, ct->type);
+        encodeCells(ct->type, cells + first * rowBytes, static_cast<size_t>(rows) * n, payload);
+        request.add(MSG_COMPUTE_BLOCK, static_cast<uint32_t>(first), payload);
+        payload.clear();
+
+        TraceScope span("peer block", "first", static_cast<uint64_t>(first));
+        uint8_t type = 0;
+        uint32_t id = 0;
+        bool ok = request.flush(s) && reader.read(type, id, payload) && id == static_cast<uint32_t>(first);
+        if (ok && type == MSG_BUSY)
+        {
+            // the peer is out of budget: hand the block back and ask again later
+            size_t pos = 0;
+            uint32_t retryAfterMs = payload.size() >= 4 ? getU32(payload, pos) : 50;
+            {
+                lock_guard<mutex> lock(q->mtx);
+                q->pending.push_front(block);
+                q->cv.notify_all();
+            }
+            this_thread::sleep_for(milliseconds(min(retryAfterMs, 1000u)));
+            continue;
+        }
+        ok = ok && type == MSG_BLOCK_RESULT;
+        try
+        {
+            size_t pos = 0;
+            ok = ok && getU32(payload, pos) == static_cast<uint32_t>(first) && getU32(payload, pos) == static_cast<uint32_t>(rows);
+            for (int r = 0; ok && r < rows; ++r)
+            {
+                ct->sums[first + r] = getU64(payload, pos);
+            }
+        }
+        catch (const exception&)
+        {
+            ok = false;
+        }
+
+        if (!ok)
+        {
+            cerr << "[s] peer " << peer.host << ":" << peer.port << " failed on rows " << first << "+" << rows << ", reassigning\n";
+            closesocket(s);
+            s = INVALID_SOCKET;
+            lock_guard<mutex> lock(q->mtx);
+            q->pending.push_front(block);
+            break;
+        }
+        ct->rowsDone.fetch_add(rows, memory_order_relaxed);
+        reportProgress(*ct, n);
+        lock_guard<mutex> lock(q->mtx);
+        --q->remaining;
+        q->cv.notify_all();
+    }
+    if (s != INVALID_SOCKET)
+    {
+        closesocket(s);
+    }
+    lock_guard<mutex> lock(q->mtx);
+    --q->alive;
+    q->cv.notify_all();
+}
+
+// Coordinator side of a run: shards the rows over the peers and writes the
+// sums they return into the task, so finishRun does not care where the rows ran. Whatever is left when every peer has failed runs locally.
+void distributeRun(shared_ptr<ClientTask> ct, int threads, function<void()> onDone)
+{
+    int n = ct->n;
+    size_t rowBytes = static_cast<size_t>(n) * elementSize(ct->type);
+    size_t maxRows = max<size_t>(1, (MAX_BLOCK_PAYLOAD - 20) / rowBytes);
+    size_t blocks = max<size_t>(1, peers.size() * BLOCKS_PER_PEER);
+    int blockRows = static_cast<int>(min<size_t>(maxRows, (n + blocks - 1) / blocks));
+
+    auto q = make_shared<BlockQueue>();
+    for (int first = 0; first < n; first += blockRows)
+    {
+        q->pending.emplace_back(first, min(blockRows, n - first));
+    }
+    q->remaining = static_cast<int>(q->pending.size());
+    q->alive = peers.size();
+
+    vector<thread> workers;
+    for (const Peer& peer : peers)
+    {
+        workers.emplace_back(peerWorker, cref(peer), q, ct, threads);
+    }
+
+    deque<pair<int, int>> leftover;
+    {
+        unique_lock<mutex> lock(q->mtx);
+        q->cv.wait(lock, [&]() { return q->remaining == 0 || q->alive == 0; });
+        leftover.swap(q->pending);
+    }
+    for (auto& w : workers)
+    {
+        w.join();
+    }
+    if (!leftover.empty())
+    {
+        cerr << "[s] no peers left, running " << leftover.size() << " blocks locally\n";
+    }
+    for (auto& block : leftover)
+    {
+        promise<void> done;
+        const char* rows = static_cast<const char*>(ct->cells()) + block.first * rowBytes;
+        computeMatrixAsync(ct->type, rows, n, block.first, block.second, threads, ct->sums.data() + block.first, ct.get(), [&done]() { done.set_value(); });
+        done.get_future().wait();
+    }
+    onDone();
+}
+
+JobScheduler::JobScheduler(unsigned cpuBudget, size_t maxJobs)
+    : budget(max(1u, cpuBudget)), maxJobs(maxJobs)
+{
+}
+
+// Reserves a job slot; every successful admit must be followed by enqueue or submit.
+bool JobScheduler::admit(uint32_t& retryAfterMs)
+{
+    lock_guard<mutex> lock(mtx);
+    if (activeJobs >= maxJobs)
+    {
+        // rough: time for the configs already waiting to drain through the budget
+        double estimate = avgRunMs * (queued + 1) / budget;
+        retryAfterMs = static_cast<uint32_t>(max(50.0, estimate));
+        traceEvent('i', "busy", "retry ms", retryAfterMs);
+        return false;
+    }
+    ++activeJobs;
+    return true;
+}
+
+bool JobScheduler::idle()
+{
+    lock_guard<mutex> lock(mtx);
+    return activeJobs == 0;
+}
+
+void JobScheduler::enqueue(const shared_ptr<ClientTask>& ct)
+{
+    uint32_t ownerId;
+    const Session* client = ct->owner(ownerId).get();
+    lock_guard<mutex> lock(mtx);
+    ct->isProcessing = true;
+    push(client, { ct, 0, nullptr });
+    dispatch();
+}
+
+// Queues a one-off job of `client` that takes coresFor(threads) once they are free;
+// run starts it and must call the callback it is given when the job is done.
+void JobScheduler::submit(const Session* client, const shared_ptr<ClientTask>& ct, int threads, function<void(function<void()>)> run)
+{
+    lock_guard<mutex> lock(mtx);
+    push(client, { ct, threads, move(run) });
+    dispatch();
+}
+
+// Called with mtx held.
+void JobScheduler::push(const Session* client, Job job)
+{
+    deque<Job>& q = queues[client];
+    if (q.empty())
+    {
+        turns.push_back(client);
+    }
+    q.push_back(move(job));
+    ++queued;
+}
+
+void JobScheduler::cancel(const shared_ptr<ClientTask>& ct)
+{
+    lock_guard<mutex> lock(mtx);
+    for (auto& kv : queues)
+    {
+        // a queued one-off job still runs: it already holds its operands
+        deque<Job>& q = kv.second;
+        auto it = find_if(q.begin(), q.end(), [&](const Job& job) { return job.ct == ct && !job.run; });
+        if (it == q.end())
+        {
+            continue;
+        }
+        q.erase(it);
+        --queued;
+        if (q.empty())
+        {
+            const Session* client = kv.first;
+            turns.erase(find(turns.begin(), turns.end(), client));
+            queues.erase(client);
+        }
+        --activeJobs;
+        ct->isProcessing = false;
+        dispatch();
+        return;
+    }
+}
+
+// 1-based place in the order dispatch() would start the queued configs, 0 if not queued.
+size_t JobScheduler::queuePosition(const ClientTask& ct)
+{
+    lock_guard<mutex> lock(mtx);
+    for (size_t t = 0; t < turns.size(); ++t)
+    {
+        const deque<Job>& mine = queues[turns[t]];
+        for (size_t i = 0; i < mine.size(); ++i)
+        {
+            if (mine[i].ct.get() != &ct)
+            {
+                continue;
+            }
+            // i full rounds go first, plus this round's turns of the clients ahead
+            size_t ahead = i;
+            for (size_t u = 0; u < turns.size(); ++u)
+            {
+                if (u != t)
+                {
+                    ahead += min(queues[turns[u]].size(), i + (u < t ? 1 : 0));
+                }
+            }
+            return ahead + 1;
+        }
+    }
+    return 0;
+}
+
+// Called with mtx held. The client at the front of `turns` waits for cores rather
+// than being overtaken, so a wide config is not starved by narrow ones; once it
+// starts, that client goes to the back of the rotation.
+void JobScheduler::dispatch()
+{
+    while (!turns.empty())
+    {
+        const Session* client = turns.front();
+        deque<Job>& q = queues[client];
+        shared_ptr<ClientTask> ct = q.front().ct;
+        int threads = q.front().threads;
+        if (!q.front().run)
+        {
+            ct->idx = ct->runOrder[ct->runPos];
+            threads = ct->cfg[ct->idx];
+        }
+        unsigned cores = coresFor(threads);
+        if (inUse + cores > budget)
+        {
+            break;
+        }
+        auto run = move(q.front().run);
+        q.pop_front();
+        --queued;
+        turns.pop_front();
+        if (q.empty())
+        {
+            queues.erase(client);
+        }
+        else
+        {
+            turns.push_back(client);
+        }
+        inUse += cores;
+        traceEvent('i', "dispatch", "threads", static_cast<uint64_t>(threads));
+        if (run)
+        {
+            auto t0 = high_resolution_clock::now();
+            run([this, cores, t0]()
+                {
+                finishJob(cores, duration<double>(high_resolution_clock::now() - t0).count());
+                });
+            continue;
+        }
+        ct->isRunning = true;
+        ct->rowsDone = 0;
+        ct->runStartNs = nowNs();
+        ct->nextProgressNs = ct->runStartNs + ct->progressIntervalMs * 1000000LL;
+
+        auto t0 = high_resolution_clock::now();
+        auto onDone = [this, ct, cores, t0]()
+            {
+            finishRun(ct, cores, duration<double>(high_resolution_clock::now() - t0).count());
+            };
+        if (!peers.empty())
+        {
+            // the coordinator mostly waits on sockets, so it gets a thread of its own
+            thread(distributeRun, ct, threads, onDone).detach();
+        }
+        else
+        {
+            computeMatrixAsync(ct->type, ct->cells(), ct->n, 0, ct->n, threads, ct->sums.data(), ct.get(), onDone);
+        }
+    }
+}
+
+void JobScheduler::finishRun(const shared_ptr<ClientTask>& ct, unsigned cores, double seconds)
+{
+    size_t i = ct->idx;
+    {
+        lock_guard<mutex> lock(ct->resMtx);
+        if (ct->resultDiagonal.empty())
+        {
+            ct->resultDiagonal = ct->sums;
+        }
+        ct->time_res[i] = seconds;
+    }
+#ifndef _WIN32
+    releaseStored(*ct);
+#endif
+    resultCache->store(ct->hash, ct->n, ct->cfg[i], seconds, ct->resultDiagonal);
+    uint32_t ownerId;
+    shared_ptr<Session> owner = ct->owner(ownerId);
+    // a stored job keeps running with nobody connected and is fetched later by id
+    bool last = ct->runPos + 1 >= ct->runOrder.size() || (!owner->connected && ct->jobId == 0) || ct->discarded;
+
+    // nothing here waits on the client: the frames go to its writer thread
+    FrameBatch batch;
+    string info;
+    putU32(info, ct->cfg[i]);
+    putF64(info, seconds);
+    batch.add(MSG_INFO, ownerId, info);
+    if (!last)
+    {
+        postBatch(*owner, batch);
+    }
+
+    bool idle;
+    {
+        lock_guard<mutex> lock(mtx);
+        inUse -= cores;
+        avgRunMs = avgRunMs == 0 ? seconds * 1000 : avgRunMs * 0.8 + seconds * 200;
+        ct->isRunning = false;
+        if (last)
+        {
+            --activeJobs;
+            ct->isProcessing = false;
+        }
+        else
+        {
+            ++ct->runPos;
+            push(owner.get(), { ct, 0, nullptr });
+        }
+        dispatch();
+        idle = activeJobs == 0;
+    }
+    if (idle)
+    {
+        requestTraceDump();
+    }
+
+    if (last)
+    {
+        // after isProcessing is cleared, so the client can start the task again at once
+        batch.add(MSG_PROCESSING_COMPLETED, ownerId);
+        postBatch(*owner, batch);
+    }
+}
+
+void JobScheduler::finishJob(unsigned cores, double seconds)
+{
+    bool idle;
+    {
+        lock_guard<mutex> lock(mtx);
+        inUse -= cores;
+        avgRunMs = avgRunMs == 0 ? seconds * 1000 : avgRunMs * 0.8 + seconds * 200;
+        --activeJobs;
+        dispatch();
+        idle = activeJobs == 0;
+    }
+    if (idle)
+    {
+        requestTraceDump();
+    }
+}
+
+void serveClient(SOCKET cs)
+{
+    auto session = make_shared<Session>();
+    session->sock = cs;
+    {
+        lock_guard<mutex> lock(clients_mtx);
+        clients_list[cs] = session;
+    }
+    Session& s = *session;
+    FrameReader reader{ cs };
+    thread writer(sessionWriter, session);
+
+    try
+    {
+        uint8_t type;
+        uint32_t id;
+        string payload;
+        while (reader.read(type, id, payload))
+        {
+            cerr << "[c " << cs << "] type=" << int(type) << " id=" << id << " bytes=" << payload.size() << '\n';
+
+            if (type == MSG_HELLO)
+            {
+                sendFrame(s, MSG_WELCOME, id);
+                continue;
+            }
+            if (type == MSG_UPLOAD_MATRIX)
+            {
+                // the frame holds the header; unless they come in a memfd, the
+                // `bytes` of cells follow it on the stream and are read window by window
+                size_t pos = 0;
+                int n = getU32(payload, pos);
+                int cfgCnt = getU32(payload, pos);
+                uint64_t bytes = getU64(payload, pos);
+                uint32_t elemType = getU32(payload, pos);
+                bool viaFd = (getU32(payload, pos) & UPLOAD_SHARED) != 0;
+                if (n < 0 || n > MAX_MATRIX_SIZE || cfgCnt < 0 || payload.size() != pos + static_cast<size_t>(cfgCnt) * 4)
+                {
+                    throw runtime_error("upload frame length mismatch");
+                }
+                auto reject = [&](const char* reason)
+                    {
+#ifndef _WIN32
+                    if (viaFd && !reader.fds.empty())
+                    {
+                        close(reader.fds.front());
+                        reader.fds.pop_front();
+                    }
+#endif
+                    if (!viaFd && !reader.skip(bytes))
+                    {
+                        throw runtime_error("connection lost in upload");
+                    }
+                    sendFrame(s, MSG_ERROR, id, reason);
+                    };
+                auto it = s.tasks.find(id);
+                if (it != s.tasks.end() && it->second->isProcessing)
+                {
+                    reject("BUSY: PROCESSING");
+                    continue;
+                }
+                if (it == s.tasks.end() && s.tasks.size() >= MAX_TASKS_PER_SESSION)
+                {
+                    reject("TOO MANY TASKS");
+                    continue;
+                }
+                if (elementSize(elemType) == 0)
+                {
+                    // the client may retry with a type both sides know
+                    reject("UNSUPPORTED TYPE");
+                    continue;
+                }
+                if (bytes != static_cast<uint64_t>(n) * n * elementSize(elemType))
+                {
+                    throw runtime_error("size mismatch");
+                }
+                // a re-upload under the same id replaces the task as a whole
+                auto task = make_shared<ClientTask>();
+                ClientTask& d = *task;
+                d.session = session;
+                d.id = id;
+                d.cfg.resize(cfgCnt);
+                for (int& v : d.cfg)
+                {
+                    v = getU32(payload, pos);
+                }
+                d.n = n;
+                d.type = elemType;
+                d.sums.resize(n);
+                MatrixHasher hasher;
+                hasher.add(n);
+                hasher.add(elemType);
+#ifndef _WIN32
+                if (!storeDir.empty() && bytes > 0)
+                {
+                    {
+                        lock_guard<mutex> lock(storeMtx);
+                        d.jobId = nextJobId++;
+                    }
+                    d.mapped = createStoredMatrix(d.jobId, bytes);
+                }
+#endif
+                unique_ptr<MappedMatrix> src;
+                if (viaFd)
+                {
+#ifdef _WIN32
+                    throw runtime_error("shared upload without a descriptor");
+#else
+                    if (reader.fds.empty())
+                    {
+                        throw runtime_error("shared upload without a descriptor");
+                    }
+                    int fd = reader.fds.front();
+                    reader.fds.pop_front();
+                    src = mapShared(fd, bytes);
+                    if (!d.mapped)
+                    {
+                        d.mapped = move(src);
+                    }
+#endif
+                }
+                else if (!d.mapped)
+                {
+                    d.allocate();
+                }
+                // a stored matrix may be bigger than RAM: only one window of it is
+                // resident at a time, the file keeps the rest
+                char* cells = static_cast<char*>(d.cells());
+                for (uint64_t off = 0; off < bytes; off += STORE_BLOCK_BYTES)
+                {
+                    size_t len = static_cast<size_t>(min<uint64_t>(STORE_BLOCK_BYTES, bytes - off));
+                    if (src)
+                    {
+                        memcpy(cells + off, static_cast<const char*>(src->base) + off, len);
+                    }
+                    else if (!viaFd)
+                    {
+                        if (!reader.readBody(cells + off, len))
+                        {
+                            throw runtime_error("connection lost in upload");
+                        }
+                        decodeCells(elemType, cells + off, cells + off, len / elementSize(elemType));
+                    }
+                    // same host, same byte order either way: the hash covers the cells as stored
+                    hasher.addBytes(cells + off, len);
+#ifndef _WIN32
+                    if (d.jobId != 0)
+                    {
+                        madvise(cells + off, len, MADV_DONTNEED);
+                        if (src)
+                        {
+                            madvise(static_cast<char*>(src->base) + off, len, MADV_DONTNEED);
+                        }
+                    }
+#endif
+                }
+                src.reset();
+                d.hash = hasher.finish();
+#ifndef _WIN32
+                releaseStored(d);
+#endif
+                payload.clear();
+                payload.shrink_to_fit();
+                s.tasks[id] = task;
+                if (d.jobId != 0)
+                {
+                    lock_guard<mutex> lock(storeMtx);
+                    storedJobs[d.jobId] = task;
+                }
+                string received;
+                putU32(received, d.jobId);
+                putU32(received, n);
+                sendFrame(s, MSG_MATRIX_RECEIVED, id, received);
+                continue;
+            }
+            if (type == MSG_ATTACH_JOB)
+            {
+                size_t pos = 0;
+                uint32_t jobId = getU32(payload, pos);
+                shared_ptr<ClientTask> task;
+                {
+                    lock_guard<mutex> lock(storeMtx);
+                    auto it = storedJobs.find(jobId);
+                    if (it != storedJobs.end())
+                    {
+                        task = it->second;
+                    }
+                }
+                auto it = s.tasks.find(id);
+                if (!task)
+                {
+                    sendFrame(s, MSG_ERROR, id, "NO JOB");
+                    continue;
+                }
+                if (it != s.tasks.end() && it->second != task && it->second->isProcessing)
+                {
+                    sendFrame(s, MSG_ERROR, id, "BUSY: PROCESSING");
+                    continue;
+                }
+                if (it == s.tasks.end() && s.tasks.size() >= MAX_TASKS_PER_SESSION)
+                {
+                    sendFrame(s, MSG_ERROR, id, "TOO MANY TASKS");
+                    continue;
+                }
+                {
+                    // from now on progress and completion of a running job come here
+                    lock_guard<mutex> lock(task->ownerMtx);
+                    task->session = session;
+                    task->id = id;
+                }
+                s.tasks[id] = task;
+                string received;
+                putU32(received, jobId);
+                putU32(received, task->n);
+                sendFrame(s, MSG_MATRIX_RECEIVED, id, received);
+                continue;
+            }
+
+            if (type == MSG_COMPUTE_BLOCK)
+            {
+                // peer side of coordinator mode: stateless, answered when the pool is done
+                size_t pos = 0;
+                uint32_t n = getU32(payload, pos);
+                uint32_t first = getU32(payload, pos);
+                uint32_t rows = getU32(payload, pos);
+                uint32_t parts = getU32(payload, pos);
+                uint32_t elemType = getU32(payload, pos);
+                size_t size = elementSize(elemType);
+                // checked in uint32 so first + rows cannot wrap
+                if (n == 0 || n > MAX_MATRIX_SIZE || rows == 0 || first > n || rows > n - first || size == 0
+                    || payload.size() != pos + static_cast<size_t>(rows) * n * size)
+                {
+                    sendFrame(s, MSG_ERROR, id, "BAD BLOCK");
+                    continue;
+                }
+                // a peer serving local clients too keeps to its budget; the coordinator retries
+                uint32_t retryAfterMs = 0;
+                if (!scheduler->admit(retryAfterMs))
+                {
+                    string busy;
+                    putU32(busy, retryAfterMs);
+                    sendFrame(s, MSG_BUSY, id, busy);
+                    continue;
+                }
+                int threads = static_cast<int>(min(max(1u, parts), computePool->size()));
+                size_t count = static_cast<size_t>(rows) * n;
+                auto block = make_shared<vector<uint64_t>>((count * size + 7) / 8);
+                auto sums = make_shared<vector<uint64_t>>(rows);
+                decodeCells(elemType, payload.data() + pos, block->data(), count);
+                payload.clear();
+                payload.shrink_to_fit();
+                scheduler->submit(session.get(), nullptr, threads, [=](function<void()> finished)
+                    {
+                    computeMatrixAsync(elemType, block->data(), n, first, rows, threads, sums->data(), nullptr, [session, id, block, sums, first, rows, finished]()
+                        {
+                        string result;
+                        putU32(result, first);
+                        putU32(result, rows);
+                        for (uint64_t sum : *sums)
+                        {
+                            putU64(result, sum);
+                        }
+                        finished();
+                        postFrame(*session, MSG_BLOCK_RESULT, id, result);
+                        });
+                    });
+                continue;
+            }
+
+            if (type == MSG_OPERATE)
+            {
+                size_t pos = 0;
+                uint32_t code = getU32(payload, pos);
+                // one worker per pool thread at most; the scheduler reserves that many cores
+                int threads = static_cast<int>(min(max(1u, getU32(payload, pos)), computePool->size()));
+                uint32_t count = getU32(payload, pos);
+                auto op = operations.find(code);
+                if (op == operations.end() || count != static_cast<uint32_t>(op->second.operands))
+                {
+                    sendFrame(s, MSG_ERROR, id, "UNKNOWN OPERATION");
+                    continue;
+                }
+                vector<shared_ptr<ClientTask>> operands;
+                string problem;
+                for (uint32_t k = 0; k < count; ++k)
+                {
+                    auto it = s.tasks.find(getU32(payload, pos));
+                    if (it == s.tasks.end() || it->second->n == 0)
+                    {
+                        problem = "NO DATA";
+                    }
+                    else if (it->second->isProcessing)
+                    {
+                        problem = "BUSY: PROCESSING";
+                    }
+                    else if (!operands.empty() && it->second->n != operands[0]->n)
+                    {
+                        problem = "SIZE MISMATCH";
+                    }
+                    else if (!operands.empty() && it->second->type != operands[0]->type)
+                    {
+                        problem = "TYPE MISMATCH";
+                    }
+                    else
+                    {
+                        operands.push_back(it->second);
+                    }
+                }
+                auto old = s.tasks.find(id);
+                if (problem.empty() && old != s.tasks.end() && (old->second->isProcessing || old->second->operationReads > 0))
+                {
+                    problem = "BUSY: PROCESSING";
+                }
+                if (problem.empty() && old == s.tasks.end() && s.tasks.size() >= MAX_TASKS_PER_SESSION)
+                {
+                    problem = "TOO MANY TASKS";
+                }
+                if (!problem.empty())
+                {
+                    sendFrame(s, MSG_ERROR, id, problem);
+                    continue;
+                }
+                uint32_t retryAfterMs = 0;
+                if (!scheduler->admit(retryAfterMs))
+                {
+                    string busy;
+                    putU32(busy, retryAfterMs);
+                    sendFrame(s, MSG_BUSY, id, busy);
+                    continue;
+                }
+
+                // the result is a new task under the frame's id; it reads as running until done
+                int n = operands[0]->n;
+                auto result = make_shared<ClientTask>();
+                result->session = session;
+                result->id = id;
+                result->n = n;
+                result->type = operands[0]->type;
+                result->allocate();
+                result->sums.resize(n);
+                result->isProcessing = true;
+                s.tasks[id] = result;
+                auto in = make_shared<vector<const void*>>();
+                for (auto& operand : operands)
+                {
+                    ++operand->operationReads;
+                    in->push_back(operand->cells());
+                }
+                const Operation* operation = &op->second;
+                TileKernel kernel = operation->kernels[result->type - ELEM_INT16];
+                void* out = result->cells();
+                sendFrame(s, MSG_PROCESSING_STARTED, id);
+                scheduler->submit(session.get(), result, threads, [=](function<void()> finished)
+                    {
+                    auto t0 = high_resolution_clock::now();
+                    parallelTiles(operation->tiles(n), threads, [in, out, n, kernel](int tile)
+                        {
+                        kernel(in->data(), out, n, tile);
+                        }, [result, operands, code, t0, finished]()
+                        {
+                        double seconds = duration<double>(high_resolution_clock::now() - t0).count();
+                        int n = result->n;
+                        for (auto& operand : operands)
+                        {
+                            --operand->operationReads;
+                        }
+                        result->isProcessing = false;
+                        string done;
+                        putU32(done, code);
+                        putU32(done, n);
+                        putF64(done, seconds);
+                        uint32_t ownerId;
+                        shared_ptr<Session> owner = result->owner(ownerId);
+                        finished();
+                        postFrame(*owner, MSG_OPERATION_DONE, ownerId, done);
+                        });
+                    });
+                continue;
+            }
+
+            auto found = s.tasks.find(id);
+            if (found == s.tasks.end())
+            {
+                sendFrame(s, MSG_ERROR, id, type == MSG_START_PROCESSING ? "NO DATA" : "NO TASK");
+                continue;
+            }
+            shared_ptr<ClientTask> task = found->second;
+            ClientTask& d = *task;
+
+            if (type == MSG_START_PROCESSING)
+            {
+                if (d.n == 0 || d.cfg.empty())
+                {
+                    sendFrame(s, MSG_ERROR, id, "NO DATA");
+                    continue;
+                }
+                if (d.isProcessing || d.operationReads > 0)
+                {
+                    sendFrame(s, MSG_ERROR, id, "BUSY: PROCESSING");
+                    continue;
+                }
+
+                CachedResult cached;
+                bool hit = resultCache->lookup(d.hash, d.n, cached);
+                d.runOrder.clear();
+                d.runPos = 0;
+                FrameBatch fromCache;
+                {
+                    lock_guard<mutex> lock(d.resMtx);
+                    d.time_res.assign(d.cfg.size(), -1.0);
+                    if (hit && d.resultDiagonal.empty())
+                    {
+                        d.resultDiagonal = move(cached.diagonal);
+                    }
+                    for (size_t i = 0; i < d.cfg.size(); ++i)
+                    {
+                        auto it = cached.seconds.find(d.cfg[i]);
+                        if (hit && it != cached.seconds.end())
+                        {
+                            d.time_res[i] = it->second;
+                            string info;
+                            putU32(info, d.cfg[i]);
+                            putF64(info, it->second);
+                            fromCache.add(MSG_INFO, id, info);
+                        }
+                        else
+                        {
+                            d.runOrder.push_back(i);
+                        }
+                    }
+                }
+                if (d.runOrder.empty())
+                {
+                    // everything is cached: answer without touching the scheduler
+                    FrameBatch batch;
+                    batch.add(MSG_PROCESSING_STARTED, id);
+                    batch.buffer += fromCache.buffer;
+                    batch.add(MSG_PROCESSING_COMPLETED, id);
+                    sendBatch(s, batch);
+                    continue;
+                }
+                d.idx = d.runOrder[0];
+                uint32_t retryAfterMs = 0;
+                if (!scheduler->admit(retryAfterMs))
+                {
+                    string busy;
+                    putU32(busy, retryAfterMs);
+                    sendFrame(s, MSG_BUSY, id, busy);
+                    continue;
+                }
+                // reply before queueing so PROCESSING_STARTED cannot arrive after the first INFO
+                FrameBatch started;
+                started.add(MSG_PROCESSING_STARTED, id);
+                started.buffer += fromCache.buffer;
+                sendBatch(s, started);
+                scheduler->enqueue(task);
+            }
+            else if (type == MSG_SUBSCRIBE_PROGRESS)
+            {
+                size_t pos = 0;
+                uint32_t intervalMs = getU32(payload, pos);
+                d.progressIntervalMs = intervalMs == 0 ? 0 : max(intervalMs, 10u);
+            }
+            else if (type == MSG_REQUEST_STATUS)
+            {
+                bool processing = d.isProcessing;
+                size_t position = processing ? scheduler->queuePosition(d) : 0;
+                // state: 0 finished, 1 running, 2 waiting in the job queue
+                string status;
+                status.push_back(!processing ? 0 : position == 0 ? 1 : 2);
+                putU32(status, static_cast<uint32_t>(processing ? d.idx + 1 : d.cfg.size()));
+                putU32(status, static_cast<uint32_t>(d.cfg.size()));
+                putU32(status, static_cast<uint32_t>(position));
+                sendFrame(s, MSG_STATUS, id, status);
+            }
+            else if (type == MSG_REQUEST_RESULTS)
+            {
+                string entries;
+                uint32_t count = 0;
+                lock_guard<mutex> lock(d.resMtx);
+                for (size_t i = 0; i < d.time_res.size(); ++i)
+                {
+                    if (d.time_res[i] >= 0)
+                    {
+                        putU32(entries, d.cfg[i]);
+                        putF64(entries, d.time_res[i]);
+                        ++count;
+                    }
+                }
+                string report;
+                putU32(report, static_cast<uint32_t>(d.n));
+                putU32(report, count);
+                sendFrame(s, MSG_RESULTS, id, report + entries);
+            }
+            else if (type == MSG_REQUEST_DIAGONAL)
+            {
+                lock_guard<mutex> lock(d.resMtx);
+                if (d.resultDiagonal.empty())
+                {
+                    sendFrame(s, MSG_ERROR, id, "NO RESULT");
+                    continue;
+                }
+                // 8-byte sums: int64 for integer cells, double for float
+                string diag;
+                diag.reserve(4 + d.resultDiagonal.size() * 8);
+                putU32(diag, static_cast<uint32_t>(d.resultDiagonal.size()));
+                for (uint64_t v : d.resultDiagonal)
+                {
+                    putU64(diag, v);
+                }
+                sendFrame(s, MSG_DIAGONAL, id, diag);
+            }
+            else if (type == MSG_REQUEST_MATRIX)
+            {
+                if (d.isProcessing || d.n == 0)
+                {
+                    sendFrame(s, MSG_ERROR, id, d.n == 0 ? "NO DATA" : "BUSY: PROCESSING");
+                    continue;
+                }
+                // the cells go out a window at a time: no second copy of the matrix and no
+                // frame length to overflow; a stored one gives each window back after it
+                size_t size = elementSize(d.type);
+                uint64_t bytes = static_cast<uint64_t>(d.n) * d.n * size;
+                string head;
+                putU32(head, d.n);
+                putU32(head, d.type);
+                putU64(head, bytes);
+                FrameBatch batch;
+                batch.add(MSG_MATRIX, id, head);
+                const char* cells = static_cast<const char*>(d.cells());
+                sendBatch(s, batch, [&]()
+                    {
+                    string window;
+                    for (uint64_t off = 0; off < bytes; off += STORE_BLOCK_BYTES)
+                    {
+                        size_t len = static_cast<size_t>(min<uint64_t>(STORE_BLOCK_BYTES, bytes - off));
+                        window.clear();
+                        encodeCells(d.type, cells + off, len / size, window);
+#ifndef _WIN32
+                        if (d.jobId != 0)
+                        {
+                            madvise(const_cast<char*>(cells) + off, len, MADV_DONTNEED);
+                        }
+#endif
+                        if (sendAll(s.sock, window.data(), static_cast<int>(len)) != static_cast<int>(len))
+                        {
+                            return false;
+                        }
+                    }
+                    return true;
+                    });
+            }
+            else if (type == MSG_DISCARD_TASK)
+            {
+                // a config already on the pool finishes; its frames go to an id the client dropped
+                d.discarded = true;
+                scheduler->cancel(task);
+                s.tasks.erase(found);
+                if (d.jobId != 0)
+                {
+                    // the store file goes away with the last reference
+                    lock_guard<mutex> lock(storeMtx);
+                    storedJobs.erase(d.jobId);
+                }
+            }
+            else
+            {
+                sendFrame(s, MSG_ERROR, id, "UNKNOWN MESSAGE " + to_string(type));
+            }
+        }
+    }
+    catch (const exception& e)
+    {
+        cerr << "[s] exception: " << e.what() << '\n';
+    }
+
+    // unblocks a writer stuck on a client that stopped reading
+    shutdown(cs, SD_BOTH);
+    {
+        lock_guard<mutex> lock(s.outMtx);
+        s.closing = true;
+    }
+    s.outCv.notify_one();
+    writer.join();
+    {
+        lock_guard<mutex> lock(s.sendMtx);
+        s.connected = false;
+        closesocket(cs);
+    }
+    for (auto& kv : s.tasks)
+    {
+        if (kv.second->jobId == 0)
+        {
+            scheduler->cancel(kv.second);
+        }
+    }
+    s.tasks.clear();    // tasks point back at the session
+    lock_guard<mutex> lock(clients_mtx);
+    clients_list.erase(cs);
+}
+
+#ifndef _WIN32
+// Drops stored jobs that have had no connection, run or operation for
+// storeTtlSec, so uploads that are never discarded do not fill the disk.
+// The file is unmapped and unlinked with the last reference to the task.
+void sweepStore()
+{
+    int64_t ttlNs = storeTtlSec * 1000000000LL;
+    while (true)
+    {
+        this_thread::sleep_for(seconds(min(60, max(1, storeTtlSec / 4))));
+        int64_t now = nowNs();
+        vector<shared_ptr<ClientTask>> expired;     // released outside the lock
+        lock_guard<mutex> lock(storeMtx);
+        for (auto it = storedJobs.begin(); it != storedJobs.end(); )
+        {
+            ClientTask& ct = *it->second;
+            uint32_t ownerId;
+            bool used = ct.owner(ownerId)->connected || ct.isProcessing || ct.operationReads > 0;
+            if (used)
+            {
+                ct.unusedSinceNs = 0;
+            }
+            else if (ct.unusedSinceNs == 0)
+            {
+                ct.unusedSinceNs = now;
+            }
+            else if (now - ct.unusedSinceNs >= ttlNs)
+            {
+                cerr << "[s] job " << it->first << " unused for " << storeTtlSec << " s, dropped\n";
+                expired.push_back(move(it->second));
+                it = storedJobs.erase(it);
+                continue;
+            }
+            ++it;
+        }
+    }
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    unsigned cpuBudget = max(1u, thread::hardware_concurrency());
+    size_t maxJobs = 64;
+    size_t cacheMb = 64;
+    string unixPath = DEFAULT_UNIX_PATH;
+    bool unixPathSet = false;
+    uint16_t port = DEFAULT_PORT;
+    int benchOps = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--row-delay-ms" && i + 1 < argc)
+        {
+            // old demo behaviour: artificially slow rows so status polling has something to show
+            rowDelayMs = atoi(argv[++i]);
+        }
+        else if (arg == "--cpu-budget" && i + 1 < argc)
+        {
+            cpuBudget = static_cast<unsigned>(atoi(argv[++i]));
+        }
+        else if (arg == "--max-jobs" && i + 1 < argc)
+        {
+            maxJobs = static_cast<size_t>(atoi(argv[++i]));
+        }
+        else if (arg == "--cache-mb" && i + 1 < argc)
+        {
+            cacheMb = static_cast<size_t>(atoi(argv[++i]));
+        }
+        else if (arg == "--unix" && i + 1 < argc)
+        {
+            // local clients; an empty path turns the Unix socket off
+            unixPath = argv[++i];
+            unixPathSet = true;
+        }
+        else if (arg == "--store-dir" && i + 1 < argc)
+        {
+            // uploads go to mmap'ed files here and stay available by job id after disconnect,
+            // until DISCARD or until nobody has used them for --store-ttl seconds
+            storeDir = argv[++i];
+        }
+        else if (arg == "--store-ttl" && i + 1 < argc)
+        {
+            storeTtlSec = max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--trace" && i + 1 < argc)
+        {
+            startTrace(argv[++i]);
+        }
+        else if (arg == "--bench-ops" && i + 1 < argc)
+        {
+            benchOps = atoi(argv[++i]);
+        }
+        else if (arg == "--port" && i + 1 < argc)
+        {
+            port = static_cast<uint16_t>(atoi(argv[++i]));
+        }
+        else if (arg == "--peers" && i + 1 < argc)
+        {
+            // coordinator mode: host:port,host:port,... of other server instances
+            istringstream list(argv[++i]);
+            string item;
+            while (getline(list, item, ','))
+            {
+                size_t colon = item.rfind(':');
+                if (colon == string::npos)
+                {
+                    peers.push_back({ item, to_string(DEFAULT_PORT) });
+                }
+                else
+                {
+                    peers.push_back({ item.substr(0, colon), item.substr(colon + 1) });
+                }
+            }
+        }
+        else
+        {
+            cerr << "usage: server [--row-delay-ms N] [--cpu-budget CORES] [--max-jobs N] [--cache-mb MB] [--unix PATH] [--port N] [--peers HOST:PORT,...] [--store-dir DIR [--store-ttl SEC]] [--bench-ops N] [--trace FILE]\n"
+                << "  the Unix socket (default " << DEFAULT_UNIX_PATH << ", --unix \"\" turns it off) is created mode 0600, for this user only\n"
+                << "  stored jobs nobody has used for --store-ttl seconds (default 3600, 0 = never) are deleted\n";
+            return 1;
+        }
+    }
+#ifdef _WIN32
+    if (!storeDir.empty())
+    {
+        cerr << "[ERROR] --store-dir needs mmap\n";
+        return 1;
+    }
+#else
+    if (!storeDir.empty() && mkdir(storeDir.c_str(), 0700) != 0 && errno != EEXIST)
+    {
+        cerr << "[ERROR] cannot create " << storeDir << "\n";
+        return 1;
+    }
+    if (!storeDir.empty() && storeTtlSec > 0)
+    {
+        thread(sweepStore).detach();
+    }
+#endif
+    if (!unixPathSet && port != DEFAULT_PORT)
+    {
+        // several instances on one host must not take over each other's socket file
+        unixPath = "/tmp/matrix-server-" + to_string(port) + ".sock";
+    }
+
+    computePool = make_unique<ComputePool>(cpuBudget);
+    scheduler = make_unique<JobScheduler>(cpuBudget, maxJobs);
+    resultCache = make_unique<ResultCache>(cacheMb * 1024 * 1024);
+    if (benchOps > 0)
+    {
+        for (uint32_t type : { ELEM_INT16, ELEM_INT32, ELEM_INT64, ELEM_FLOAT })
+        {
+            withElementType(type, [&](auto zero)
+                {
+                benchOperations<decltype(zero)>(type, benchOps, static_cast<int>(cpuBudget));
+                });
+        }
+        dumpTrace();
+        return 0;
+    }
+
+#ifdef _WIN32
+    WSADATA wsa{};
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+    {
+        cerr << "[ERROR] WSAStartup failed\n";
+        return 1;
+    }
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    SOCKET serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverSocket == INVALID_SOCKET)
+    {
+        cerr << "[ERROR] socket() failed\n";
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return 1;
+    }
+
+#ifndef _WIN32
+    // a peer restarted after a crash must get its port back while old connections linger
+    int reuse = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(serverSocket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+    {
+        cerr << "[ERROR] bind() failed\n";
+        closesocket(serverSocket);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return 1;
+    }
+
+    listen(serverSocket, SOMAXCONN);
+    cerr << "[s] Listening on port " << port << "\n";
+    if (!peers.empty())
+    {
+        cerr << "[s] Coordinator for " << peers.size() << " peers\n";
+    }
+    if (tracing)
+    {
+        thread(traceWriter).detach();
+    }
+
+#ifndef _WIN32
+    if (!unixPath.empty())
+    {
+        SOCKET unixSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un ua{};
+        ua.sun_family = AF_UNIX;
+        strncpy(ua.sun_path, unixPath.c_str(), sizeof(ua.sun_path) - 1);
+        unlink(unixPath.c_str());   // stale socket file from an earlier run
+        // owner only (0600): whoever can connect can run and discard every job
+        mode_t oldMask = umask(0177);
+        bool bound = unixSocket != INVALID_SOCKET && bind(unixSocket, reinterpret_cast<sockaddr*>(&ua), sizeof(ua)) == 0;
+        umask(oldMask);
+        if (!bound || listen(unixSocket, SOMAXCONN) < 0)
+        {
+            cerr << "[ERROR] cannot listen on " << unixPath << "\n";
+            return 1;
+        }
+        cerr << "[s] Listening on " << unixPath << "\n";
+        thread([unixSocket]()
+            {
+            while (true)
+            {
+                SOCKET clientSocket = accept(unixSocket, nullptr, nullptr);
+                if (clientSocket != INVALID_SOCKET)
+                {
+                    thread(serveClient, clientSocket).detach();
+                }
+            }
+            }).detach();
+    }
+#endif
 
     while (true) 
     {
@@ -304,6 +2997,8 @@ int main()
         thread(serveClient, clientSocket).detach();
     }
     closesocket(serverSocket);
+#ifdef _WIN32
     WSACleanup();
+#endif
     return 0;
 }
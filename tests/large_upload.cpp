@@ -0,0 +1,245 @@
+// Uploads an int16 matrix bigger than the largest frame the server accepts
+// (MAX_BLOCK_PAYLOAD, 1 GiB) over TCP, runs it and checks every row sum.
+// The cells are generated while they are sent, so neither side has to hold them:
+// with --store-dir the server streams them into the job file.
+// With `fetch JOB` it attaches that stored job on a new connection instead and
+// checks every cell of the matrix the server streams back.
+//
+// usage: large_upload [port] [n] [fetch JOB]      (run by tests/run_tests.sh)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+enum MessageType : uint8_t
+{
+    MSG_UPLOAD_MATRIX = 3,
+    MSG_MATRIX_RECEIVED,
+    MSG_START_PROCESSING,
+    MSG_PROCESSING_STARTED,
+    MSG_INFO,
+    MSG_PROCESSING_COMPLETED,
+    MSG_ERROR = 13,
+    MSG_REQUEST_DIAGONAL = 17,
+    MSG_DIAGONAL,
+    MSG_ATTACH_JOB = 22,
+    MSG_REQUEST_MATRIX = 25,
+    MSG_MATRIX
+};
+
+const uint32_t ELEM_INT16 = 1;
+const uint64_t MAX_BLOCK_PAYLOAD = 1u << 30;
+
+int16_t cell(uint64_t i, uint64_t j)
+{
+    return static_cast<int16_t>((i * 131 + j * 71) % 60001) - 30000;
+}
+
+bool sendAll(int s, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = send(s, data, length, 0);
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool recvAll(int s, char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = recv(s, data, length, 0);
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+void putU32(string& out, uint32_t v)
+{
+    v = htonl(v);
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+uint32_t getU32(const char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+bool sendFrame(int s, uint8_t type, uint32_t id, const string& payload = string())
+{
+    string frame;
+    putU32(frame, static_cast<uint32_t>(payload.size()));
+    frame.push_back(static_cast<char>(type));
+    putU32(frame, id);
+    return sendAll(s, (frame + payload).data(), frame.size() + payload.size());
+}
+
+bool readFrame(int s, uint8_t& type, string& payload)
+{
+    char header[9];
+    if (!recvAll(s, header, sizeof(header)))
+    {
+        return false;
+    }
+    type = static_cast<uint8_t>(header[4]);
+    payload.resize(getU32(header));
+    return recvAll(s, &payload[0], payload.size());
+}
+
+int fail(const string& what)
+{
+    cerr << "FAIL: " << what << "\n";
+    return 1;
+}
+
+// MATRIX = [n][type][bytes u64] with the cells after the frame; read a row at a time.
+int fetch(int s, uint64_t n, uint32_t job)
+{
+    string payload;
+    putU32(payload, job);
+    sendFrame(s, MSG_ATTACH_JOB, 1, payload);
+    uint8_t type;
+    if (!readFrame(s, type, payload) || type != MSG_MATRIX_RECEIVED || getU32(payload.data() + 4) != n)
+    {
+        return fail("attach: " + payload);
+    }
+    sendFrame(s, MSG_REQUEST_MATRIX, 1);
+    uint64_t bytes = n * n * sizeof(int16_t);
+    if (!readFrame(s, type, payload) || type != MSG_MATRIX || payload.size() != 16 || getU32(payload.data()) != n
+        || getU32(payload.data() + 4) != ELEM_INT16 || (static_cast<uint64_t>(getU32(payload.data() + 8)) << 32 | getU32(payload.data() + 12)) != bytes)
+    {
+        return fail("bad MATRIX header: " + payload);
+    }
+    string row(n * sizeof(int16_t), '\0');
+    for (uint64_t i = 0; i < n; ++i)
+    {
+        if (!recvAll(s, &row[0], row.size()))
+        {
+            return fail("matrix cut off at row " + to_string(i));
+        }
+        for (uint64_t j = 0; j < n; ++j)
+        {
+            int16_t v = static_cast<int16_t>(static_cast<uint8_t>(row[2 * j]) << 8 | static_cast<uint8_t>(row[2 * j + 1]));
+            if (v != cell(i, j))
+            {
+                return fail("cell " + to_string(i) + "," + to_string(j));
+            }
+        }
+    }
+    close(s);
+    cout << "PASS: " << bytes << " bytes fetched back\n";
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int port = argc > 1 ? atoi(argv[1]) : 12345;
+    uint64_t n = argc > 2 ? strtoull(argv[2], nullptr, 10) : 23200;
+    uint64_t bytes = n * n * sizeof(int16_t);
+    if (bytes <= MAX_BLOCK_PAYLOAD)
+    {
+        return fail("matrix must be larger than the frame cap");
+    }
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (s < 0 || connect(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+    {
+        return fail("cannot connect");
+    }
+    if (argc > 4 && string(argv[3]) == "fetch")
+    {
+        return fetch(s, n, static_cast<uint32_t>(atoi(argv[4])));
+    }
+
+    // [n][cfg count][bytes u64][type][flags][cfg...], cells after the frame
+    string header;
+    putU32(header, static_cast<uint32_t>(n));
+    putU32(header, 1);
+    putU32(header, static_cast<uint32_t>(bytes >> 32));
+    putU32(header, static_cast<uint32_t>(bytes));
+    putU32(header, ELEM_INT16);
+    putU32(header, 0);
+    putU32(header, 1);
+    if (!sendFrame(s, MSG_UPLOAD_MATRIX, 1, header))
+    {
+        return fail("upload header");
+    }
+    vector<int64_t> expected(n);
+    string row(n * sizeof(int16_t), '\0');
+    for (uint64_t i = 0; i < n; ++i)
+    {
+        for (uint64_t j = 0; j < n; ++j)
+        {
+            uint16_t v = static_cast<uint16_t>(cell(i, j));
+            row[2 * j] = static_cast<char>(v >> 8);
+            row[2 * j + 1] = static_cast<char>(v);
+            if (j % 2 == 0)
+            {
+                expected[i] += cell(i, j);
+            }
+        }
+        if (!sendAll(s, row.data(), row.size()))
+        {
+            return fail("upload body");
+        }
+    }
+
+    uint8_t type;
+    string payload;
+    if (!readFrame(s, type, payload) || type != MSG_MATRIX_RECEIVED)
+    {
+        return fail("no MATRIX_RECEIVED: " + payload);
+    }
+    cout << "uploaded " << bytes << " bytes, job " << getU32(payload.data()) << "\n";
+
+    sendFrame(s, MSG_START_PROCESSING, 1);
+    do
+    {
+        if (!readFrame(s, type, payload) || type == MSG_ERROR)
+        {
+            return fail("run: " + payload);
+        }
+    } while (type != MSG_PROCESSING_COMPLETED);
+
+    sendFrame(s, MSG_REQUEST_DIAGONAL, 1);
+    if (!readFrame(s, type, payload) || type != MSG_DIAGONAL || getU32(payload.data()) != n || payload.size() != 4 + n * 8)
+    {
+        return fail("bad DIAGONAL");
+    }
+    for (uint64_t i = 0; i < n; ++i)
+    {
+        uint64_t v = static_cast<uint64_t>(getU32(payload.data() + 4 + i * 8)) << 32 | getU32(payload.data() + 8 + i * 8);
+        if (static_cast<int64_t>(v) != expected[i])
+        {
+            return fail("row " + to_string(i) + " sum " + to_string(static_cast<int64_t>(v)) + ", expected " + to_string(expected[i]));
+        }
+    }
+    close(s);
+    cout << "PASS: " << n << " row sums match\n";
+    return 0;
+}
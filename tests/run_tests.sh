@@ -0,0 +1,23 @@
+#!/bin/sh
+# Builds the server and the tests, then runs them against a server with a
+# throwaway --store-dir. Needs Linux, g++ and about 1.1 GB of free disk.
+set -e
+cd "$(dirname "$0")/.."
+out=$(mktemp -d)
+trap 'kill $server 2>/dev/null; rm -rf "$out"' EXIT
+g++ -std=c++17 -O2 -pthread server.cpp -o "$out/server"
+g++ -std=c++17 -O2 tests/large_upload.cpp -o "$out/large_upload"
+
+port=${PORT:-23999}
+n=23200
+"$out/server" --port "$port" --store-dir "$out/store" --cpu-budget 2 2>/dev/null &
+server=$!
+sleep 1
+"$out/large_upload" "$port" "$n" | tee "$out/upload.log"
+job=$(awk '/^uploaded/ { print $NF }' "$out/upload.log")
+# the same matrix back: more than a frame can carry, streamed after a header frame
+"$out/large_upload" "$port" "$n" fetch "$job"
+# the cells went to the job file window by window, not into the server's memory
+peak=$(awk '/VmHWM/ { print $2 }' "/proc/$server/status")
+echo "server peak RSS: ${peak} kB"
+[ "$peak" -lt 262144 ]